@@ -0,0 +1,460 @@
+// Link layer benchmark.
+// Every case runs a receiver and a transmitter in child processes, each on
+// its own pseudo terminal or socket pair, while this process carries bytes
+// between the two through the channel model. Sweeps payload size, bit error
+// rate, propagation delay and baud rate (0 for unlimited), and writes one CSV
+// row per case. With -x both children send at once over a full duplex link,
+// with -F they offer forward error correction.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "link_layer.h"
+#include "logger.h"
+#include "macros.h"
+#include "channel.h"
+
+#define BENCH_MAX_VALUES 16
+#define BENCH_TIMEOUT 120000 // ms before a case is given up
+
+const char *transportNames[] = {"serial", "pty", "socket", "memory"};
+
+typedef struct
+{
+    int payload;
+    double bitErrorRate;
+    int delayMs;
+    int baudRate;
+} BenchCase;
+
+typedef struct
+{
+    int values;
+    double value[BENCH_MAX_VALUES];
+} BenchSweep;
+
+typedef struct
+{
+    long bytes;      // transferred per case
+    int retries;     // nRetransmissions of the link layer
+    int duplex;      // the receiver sends bytes back at the same time
+    int fec;         // offer forward error correction
+    TransportType transport;
+    const char *output;
+    BenchSweep payloads;
+    BenchSweep errorRates;
+    BenchSweep delays;
+    BenchSweep baudRates;
+} BenchOptions;
+
+// Parses a comma separated list of numbers.
+int parseSweep(const char *text, BenchSweep *sweep)
+{
+    sweep->values = 0;
+    while (*text != '\0' && sweep->values < BENCH_MAX_VALUES)
+    {
+        char *end;
+        sweep->value[sweep->values++] = strtod(text, &end);
+        if (end == text)
+            return -1;
+        text = *end == ',' ? end + 1 : end;
+    }
+    return sweep->values > 0 ? 0 : -1;
+}
+
+// Opens a pseudo terminal in raw mode. Returns the master fd and the slave
+// name in name.
+int openPty(char *name, int nameSize)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+        return -1;
+
+    struct termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+
+    strncpy(name, ptsname(master), nameSize - 1);
+    name[nameSize - 1] = '\0';
+    return master;
+}
+
+// Opens one end of the cable. Returns the descriptor this process carries
+// bytes with, fills name with what the child opens and childFd with the
+// descriptor to close once the child has it (-1 for none).
+int openPort(TransportType transport, char *name, int nameSize, int *childFd)
+{
+    if (transport == TransportSocket)
+    {
+        int fds[2];
+        if (transportSocketpair(fds) < 0)
+            return -1;
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        snprintf(name, nameSize, "%d", fds[1]);
+        *childFd = fds[1];
+        return fds[0];
+    }
+    *childFd = -1;
+    return openPty(name, nameSize);
+}
+
+LinkLayer benchParameters(const char *port, LinkLayerRole role, const BenchCase *benchCase,
+                          const BenchOptions *options)
+{
+    LinkLayer params;
+    memset(&params, 0, sizeof(params));
+    strncpy(params.serialPort, port, sizeof(params.serialPort) - 1);
+    params.transport = options->transport;
+    params.role = role;
+    params.baudRate = benchCase->baudRate;
+    params.nRetransmissions = options->retries;
+    params.timeout = TIMEOUT;
+    params.windowSize = WINDOW_SIZE;
+    params.arqMode = ARQ_MODE;
+    params.fcsType = FCS_TYPE;
+    params.maxPayloadSize = benchCase->payload;
+    params.compression = FALSE;
+    params.duplex = options->duplex;
+    params.fec = options->fec;
+    return params;
+}
+
+typedef struct
+{
+    int fd;
+    long bytes;
+    int result;
+} BenchStream;
+
+// Sends bytes of random data in payload sized frames.
+void *sendStream(void *arg)
+{
+    BenchStream *stream = (BenchStream *)arg;
+    int payload = llmaxpayload(stream->fd);
+    unsigned char *buf = (unsigned char *)malloc(payload);
+    for (int i = 0; i < payload; i++)
+        buf[i] = rand();
+
+    stream->result = 0;
+    for (long sent = 0; sent < stream->bytes; sent += payload)
+    {
+        int size = stream->bytes - sent < payload ? stream->bytes - sent : payload;
+        if (llwrite(buf, size, stream->fd) < 0)
+        {
+            stream->result = -1;
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// Reads until bytes arrived.
+void *receiveStream(void *arg)
+{
+    BenchStream *stream = (BenchStream *)arg;
+    unsigned char *buf = (unsigned char *)malloc(llmaxpayload(stream->fd));
+    long received = 0;
+    stream->result = 0;
+    while (received < stream->bytes)
+    {
+        int size = llread(buf, stream->fd);
+        if (size < 0)
+        {
+            stream->result = -1;
+            break;
+        }
+        received += size;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Runs the stream this end sends and, in duplex, the one it receives in a
+// second thread. Return "0" if both got through.
+int runStreams(int fd, int sending, const BenchOptions *options)
+{
+    BenchStream out = {fd, options->bytes, 0};
+    BenchStream in = {fd, options->bytes, 0};
+    if (!options->duplex)
+    {
+        if (sending)
+            sendStream(&out);
+        else
+            receiveStream(&in);
+        return out.result < 0 || in.result < 0 ? -1 : 0;
+    }
+
+    if (llduplex(fd) != TRUE)
+        return -1;
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, receiveStream, &in) != 0)
+        return -1;
+    sendStream(&out);
+    pthread_join(reader, NULL);
+    return out.result < 0 || in.result < 0 ? -1 : 0;
+}
+
+// Child: sends bytes of random data in payload sized frames and reports the
+// link statistics on resultFd.
+int runTransmitter(const char *port, const BenchCase *benchCase, const BenchOptions *options, int resultFd)
+{
+    LinkLayer params = benchParameters(port, LlTx, benchCase, options);
+    int fd = llopen(params);
+    if (fd < 0)
+        return 1;
+
+    if (runStreams(fd, TRUE, options) < 0)
+        return 1;
+    if (llclose(fd, params, FALSE) < 0)
+        return 1;
+
+    write(resultFd, llstatistics(fd), sizeof(LinkStatistics));
+    return 0;
+}
+
+// Child: reads until every byte arrived.
+int runReceiver(const char *port, const BenchCase *benchCase, const BenchOptions *options)
+{
+    LinkLayer params = benchParameters(port, LlRx, benchCase, options);
+    int fd = llopen(params);
+    if (fd < 0)
+        return 1;
+
+    int result = runStreams(fd, FALSE, options);
+    llclose(fd, params, FALSE);
+    return result < 0 ? 1 : 0;
+}
+
+// Exit code of a child, or minus the signal that killed it.
+int childStatus(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+}
+
+// Carries bytes between the two masters until both children exit. Once one
+// of them fails the other can never finish, so it is killed right away
+// instead of left to the watchdog. statuses gets each child's childStatus.
+// Returns "0" if both succeeded.
+int runCable(int masterTx, int masterRx, pid_t tx, pid_t rx, const BenchCase *benchCase, int statuses[2])
+{
+    ChannelConfig config;
+    memset(&config, 0, sizeof(config));
+    config.bitErrorRate = benchCase->bitErrorRate;
+    config.delayMs = benchCase->delayMs;
+    config.baudRate = benchCase->baudRate;
+    config.seed = 1;
+    static Channel tx2rx, rx2tx;
+    channelInit(&tx2rx, &config);
+    config.seed = 2;
+    channelInit(&rx2tx, &config);
+
+    unsigned char buf[CHANNEL_QUEUE_SIZE];
+    double deadline = channelNow() + BENCH_TIMEOUT;
+    pid_t children[2] = {tx, rx};
+    int alive[2] = {TRUE, TRUE};
+    int failed = 0;
+
+    while (alive[0] || alive[1])
+    {
+        int status;
+        pid_t done;
+        while ((done = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            int role = done == tx ? 0 : 1;
+            alive[role] = FALSE;
+            statuses[role] = childStatus(status);
+            if (statuses[role] != 0)
+            {
+                failed = 1;
+                if (alive[1 - role])
+                    kill(children[1 - role], SIGKILL);
+            }
+        }
+        if (channelNow() > deadline)
+        {
+            fprintf(stderr, "case timed out after %d ms\n", BENCH_TIMEOUT);
+            for (int role = 0; role < 2; role++)
+                if (alive[role])
+                    kill(children[role], SIGKILL);
+            failed = 1;
+            deadline = channelNow() + BENCH_TIMEOUT;
+        }
+
+        double now = channelNow();
+        int waitTx = channelDeliver(&tx2rx, masterRx, now);
+        int waitRx = channelDeliver(&rx2tx, masterTx, now);
+        int wait = 10;
+        if (waitTx >= 0 && waitTx < wait)
+            wait = waitTx;
+        if (waitRx >= 0 && waitRx < wait)
+            wait = waitRx;
+
+        struct pollfd pfd[2] = {{masterTx, channelRoom(&tx2rx) > 0 ? POLLIN : 0, 0},
+                                {masterRx, channelRoom(&rx2tx) > 0 ? POLLIN : 0, 0}};
+        if (poll(pfd, 2, wait) <= 0)
+            continue;
+
+        now = channelNow();
+        if (pfd[0].revents & POLLIN)
+        {
+            int room = channelRoom(&tx2rx) < (int)sizeof(buf) ? channelRoom(&tx2rx) : (int)sizeof(buf);
+            int size = read(masterTx, buf, room);
+            if (size > 0)
+                channelPush(&tx2rx, buf, size, now);
+        }
+        if (pfd[1].revents & POLLIN)
+        {
+            int room = channelRoom(&rx2tx) < (int)sizeof(buf) ? channelRoom(&rx2tx) : (int)sizeof(buf);
+            int size = read(masterRx, buf, room);
+            if (size > 0)
+                channelPush(&rx2tx, buf, size, now);
+        }
+        if ((pfd[0].revents | pfd[1].revents) & (POLLHUP | POLLERR))
+            usleep(1000); // a side closed its port, wait for it to exit
+    }
+    return failed;
+}
+
+// Runs one case and appends its row to csv.
+void runCase(const BenchCase *benchCase, const BenchOptions *options, FILE *csv)
+{
+    char portTx[64], portRx[64];
+    int childTx, childRx;
+    int masterTx = openPort(options->transport, portTx, sizeof(portTx), &childTx);
+    int masterRx = openPort(options->transport, portRx, sizeof(portRx), &childRx);
+    int results[2];
+    if (masterTx < 0 || masterRx < 0 || pipe(results) < 0)
+    {
+        perror("bench");
+        exit(1);
+    }
+
+    fflush(NULL);
+    pid_t rx = fork();
+    if (rx == 0)
+        exit(runReceiver(portRx, benchCase, options));
+    usleep(100000); // receiver waiting for SET before the transmitter starts
+
+    double start = channelNow();
+    pid_t tx = fork();
+    if (tx == 0)
+        exit(runTransmitter(portTx, benchCase, options, results[1]));
+    close(results[1]);
+    if (childTx >= 0)
+        close(childTx);
+    if (childRx >= 0)
+        close(childRx);
+
+    int statuses[2] = {0, 0};
+    int failed = runCable(masterTx, masterRx, tx, rx, benchCase, statuses);
+    double elapsed = channelNow() - start;
+
+    LinkStatistics statistics;
+    memset(&statistics, 0, sizeof(statistics));
+    if (read(results[0], &statistics, sizeof(statistics)) != sizeof(statistics))
+        failed = 1;
+    close(results[0]);
+    close(masterTx);
+    close(masterRx);
+
+    double goodput = statisticsGoodput(&statistics);
+    double efficiency = benchCase->baudRate > 0 ? goodput / benchCase->baudRate : 0;
+    fprintf(csv, "%d,%g,%d,%d,%ld,%d,%.0f,%.0f,%.4f,%lld,%lld,%lld,%lld,%lld,%s,%d,%d,%lld,%d,%d\n",
+            benchCase->payload, benchCase->bitErrorRate, benchCase->delayMs, benchCase->baudRate,
+            options->bytes, !failed, elapsed, goodput, efficiency,
+            statistics.framesSent, statistics.retransmissions, statistics.rejects,
+            statistics.timeouts, statistics.lineBytesSent, transportNames[options->transport], options->duplex,
+            options->fec, statistics.fecFrames, statuses[0], statuses[1]);
+    fflush(csv);
+    fprintf(stderr, "payload %5d  ber %-6g  delay %3d ms  baud %6d  %s  efficiency %.3f  goodput %.0f bit/s\n",
+            benchCase->payload, benchCase->bitErrorRate, benchCase->delayMs, benchCase->baudRate,
+            failed ? "FAILED" : "ok    ", efficiency, goodput);
+    if (failed)
+        fprintf(stderr, "  tx status %d, rx status %d (negative: killed by that signal)\n", statuses[0], statuses[1]);
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-o file.csv] [-s bytes] [-r retries] [-f payloads] [-e bit error rates]\n"
+                    "          [-d delays ms] [-b baud rates] [-t pty|socket] [-x] [-F]\n"
+                    "Lists are comma separated, e.g. -f 512,1024,4096 -e 0,1e-5\n"
+                    "A baud rate of 0 does not limit the line.\n"
+                    "-x sends the bytes both ways at once; goodput then counts both directions.\n"
+                    "-F offers forward error correction, used while the frame error rate is high.\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options = {.bytes = 32768, .retries = 10, .duplex = FALSE, .fec = FALSE, .transport = TransportPty, .output = "bench.csv"};
+    parseSweep("512,1024,4096", &options.payloads);
+    parseSweep("0,1e-6,1e-5", &options.errorRates);
+    parseSweep("0,50", &options.delays);
+    parseSweep("115200,460800", &options.baudRates);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:s:r:f:e:d:b:t:xF")) != -1)
+    {
+        int bad = 0;
+        switch (opt)
+        {
+        case 'o': options.output = optarg; break;
+        case 's': options.bytes = atol(optarg); break;
+        case 'r': options.retries = atoi(optarg); break;
+        case 'f': bad = parseSweep(optarg, &options.payloads); break;
+        case 'e': bad = parseSweep(optarg, &options.errorRates); break;
+        case 'd': bad = parseSweep(optarg, &options.delays); break;
+        case 'b': bad = parseSweep(optarg, &options.baudRates); break;
+        case 'x': options.duplex = TRUE; break;
+        case 'F': options.fec = TRUE; break;
+        case 't':
+            if (strcmp(optarg, "pty") == 0)
+                options.transport = TransportPty;
+            else if (strcmp(optarg, "socket") == 0)
+                options.transport = TransportSocket;
+            else
+                bad = -1;
+            break;
+        default: usage(argv[0]);
+        }
+        if (bad < 0)
+            usage(argv[0]);
+    }
+
+    FILE *csv = fopen(options.output, "w");
+    if (csv == NULL)
+    {
+        perror(options.output);
+        exit(1);
+    }
+    fprintf(csv, "payload,bit_error_rate,delay_ms,baud_rate,bytes,ok,elapsed_ms,goodput_bps,efficiency,"
+                 "frames,retransmissions,rejects,timeouts,line_bytes,transport,duplex,fec,fec_frames,tx_status,rx_status\n");
+
+    atomic_store(&logLevel, LOG_LEVEL_ERROR);
+    signal(SIGPIPE, SIG_IGN); // bytes still in flight when a socket end has exited
+    for (int b = 0; b < options.baudRates.values; b++)
+        for (int d = 0; d < options.delays.values; d++)
+            for (int e = 0; e < options.errorRates.values; e++)
+                for (int f = 0; f < options.payloads.values; f++)
+                {
+                    BenchCase benchCase = {options.payloads.value[f], options.errorRates.value[e],
+                                           options.delays.value[d], options.baudRates.value[b]};
+                    runCase(&benchCase, &options, csv);
+                }
+
+    fclose(csv);
+    return 0;
+}
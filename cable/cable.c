@@ -1,10 +1,15 @@
 // Virtual cable program to test serial port.
 // Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Each direction goes through a channel model (see channel.h) configured
+// from the command line. The traffic can be recorded to a trace (see
+// trace.h) and replayed later into one end.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,14 +18,30 @@
 #include <termios.h>
 #include <unistd.h>
 
+#include "channel.h"
+#include "trace.h"
+
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
 #define BAUDRATE B38400
-#define _POSIX_SOURCE 1 // POSIX compliant source
+#define _POSIX_C_SOURCE 200809L // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
-#define BUF_SIZE 2048
+#define BUF_SIZE 65536
+
+// Bit error rate of the noise command when none is given with -e or -g
+#define NOISE_BIT_ERROR_RATE 1e-4
+
+// Reads of the replayed end remembered to time deliveries
+#define REPLAY_READS 256
+
+// Extra quiet time before a replayed end counts as diverged (ms)
+#define REPLAY_STALL_MS 250
+
+// Ends of the cable, indexed like the trace direction they send
+#define END_TX TRACE_TX_TO_RX
+#define END_RX TRACE_RX_TO_TX
 
 typedef enum
 {
@@ -29,10 +50,31 @@ typedef enum
     CableModeNoise,
 } CableMode;
 
+const char *directionNames[] = {"Tx > Rx", "Tx < Rx"};
+const int directions[] = {TRACE_TX_TO_RX, TRACE_RX_TO_TX};
+
+Channel tx2rx;
+Channel rx2tx;
+
+// Recording
+Trace trace;
+unsigned long long bytesRead[2]; // from each end
+double lastReadAt[2];
+
+// Milliseconds until the first of two channel deadlines, -1 for none.
+int earliest(int a, int b)
+{
+    if (a < 0)
+        return b;
+    if (b < 0)
+        return a;
+    return a < b ? a : b;
+}
+
 // Returns: serial port file descriptor (fd).
 int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
 {
-    int fd = open(serialPort, O_RDWR | O_NOCTTY);
+    int fd = open(serialPort, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
     if (fd < 0)
         return -1;
@@ -46,7 +88,7 @@ int openSerialPort(const char *serialPort, struct termios *oldtio, struct termio
     newtio->c_iflag = IGNPAR;
     newtio->c_oflag = 0;
     newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 1; // Inter-character timer unused
+    newtio->c_cc[VTIME] = 0; // Inter-character timer unused
     newtio->c_cc[VMIN] = 0;  // Read without blocking
     tcflush(fd, TCIOFLUSH);
 
@@ -56,14 +98,339 @@ int openSerialPort(const char *serialPort, struct termios *oldtio, struct termio
     return fd;
 }
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+void printUsage(const char *program)
+{
+    printf("Usage: %s [-e ber] [-g enter,leave,ber] [-d delay] [-j jitter] [-b baud] [-s seed]\n"
+           "          [-w trace | -r trace -x tx|rx [-t]]\n"
+           "  -e ber               probability of each bit being flipped\n"
+           "  -g enter,leave,ber   burst errors (Gilbert-Elliott): probability per bit of\n"
+           "                       entering and leaving the bad state, and its bit error rate\n"
+           "  -d delay             propagation delay in ms\n"
+           "  -j jitter            extra random delay in ms, up to jitter\n"
+           "  -b baud              line rate in bit/s, 0 for unlimited\n"
+           "  -s seed              seed of the error generator\n"
+           "  -w trace             record both directions to trace\n"
+           "  -r trace             replay what the given end received in trace\n"
+           "  -x tx|rx             end to replay to\n"
+           "  -t                   replay in real time instead of at full speed\n"
+           "Noise starts on if -e or -g is given.\n",
+           program);
+}
+
+void recordFlip(void *observer, unsigned long long bit)
 {
-    buf[errorIndex] ^= 0xFF;
+    traceWrite(&trace, TraceFlip, *(const int *)observer, bit, 0, NULL, 0, channelNow());
+}
+
+void recordDeliver(void *observer, const unsigned char *data, int size)
+{
+    int direction = *(const int *)observer;
+    int end = direction == TRACE_TX_TO_RX ? END_RX : END_TX;
+    double now = channelNow();
+    unsigned int waitUs = bytesRead[end] > 0 ? (unsigned int)((now - lastReadAt[end]) * 1000) : 0;
+
+    traceWrite(&trace, TraceDeliver, direction, bytesRead[end], waitUs, data, size, now);
+}
+
+void changeMode(CableMode *cableMode, CableMode mode)
+{
+    *cableMode = mode;
+    channelSetNoise(&tx2rx, mode == CableModeNoise);
+    channelSetNoise(&rx2tx, mode == CableModeNoise);
+    traceWrite(&trace, TraceMode, 0, mode, 0, NULL, 0, channelNow());
+}
+
+// Forwards what is read from fdIn into the channel, or drops it if the cable is off.
+void forward(int fdIn, Channel *channel, CableMode cableMode, int direction)
+{
+    unsigned char buf[BUF_SIZE];
+    int bytes = 0;
+
+    // take everything pending at once
+    while (bytes < BUF_SIZE)
+    {
+        int room = channelRoom(channel) - bytes;
+        if (room > BUF_SIZE - bytes)
+            room = BUF_SIZE - bytes;
+        if (room <= 0)
+            break;
+
+        int n = read(fdIn, buf + bytes, room);
+        if (n <= 0)
+            break;
+        bytes += n;
+    }
+
+    if (bytes == 0)
+        return;
+
+    double now = channelNow();
+    bytesRead[direction] += bytes;
+    lastReadAt[direction] = now;
+    traceWrite(&trace, TraceRead, direction, bytesRead[direction], 0, NULL, 0, now);
+
+    if (cableMode == CableModeOff)
+    {
+        printf("%s: %d bytes > CONNECTION OFF\n", directionNames[direction], bytes);
+        return;
+    }
+
+    unsigned long long flips = channel->flips;
+    channelPush(channel, buf, bytes, now);
+    printf("%s: %d bytes, %llu bits flipped\n", directionNames[direction], bytes, channel->flips - flips);
+}
+
+// Feeds fd with what the given end received in the trace. Each delivery waits
+// until the end has sent as many bytes as it had when it was recorded, and in
+// real time also for the recorded delay after that. If the end sent less, as
+// a timer driven end may, the delivery goes once the end has been quiet for
+// the recorded delay plus REPLAY_STALL_MS. Starts when the end sends its first byte or on the
+// "start" command.
+// Returns 0 at the end of the trace or on "end", -1 on error.
+int replayTrace(Trace *replay, int fd, int end, int realTime)
+{
+    static unsigned char data[BUF_SIZE];
+    unsigned char buf[BUF_SIZE];
+    char rxStdin[256];
+    int direction = end == END_RX ? TRACE_TX_TO_RX : TRACE_RX_TO_TX;
+
+    // when the end had sent the bytes of each of its last reads
+    unsigned long long readCounts[REPLAY_READS];
+    double readTimes[REPLAY_READS];
+    int reads = 0;
+    unsigned long long endBytes = 0;
+
+    TraceRecord record;
+    int pending = FALSE;
+    unsigned int offset = 0;
+    int started = FALSE;
+    double startedAt = 0;
+    double lastDeliverAt = 0;
+    unsigned long long lastTimeUs = 0;
+    int first = TRUE;
+    unsigned long long deliveries = 0;
+    unsigned long long flips = 0;
+    int result = 0;
+
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+
+    while (TRUE)
+    {
+        if (!pending)
+        {
+            int status = traceRead(replay, &record, data, sizeof(data));
+            if (status <= 0)
+            {
+                result = status;
+                break;
+            }
+            if (record.direction != direction)
+                continue;
+            if (record.type == TraceFlip)
+                flips++;
+            if (record.type != TraceDeliver)
+                continue;
+            pending = TRUE;
+            offset = 0;
+        }
+
+        int timeout = -1;
+        fds[0].events = POLLIN;
+        double now = channelNow();
+
+        if (started)
+        {
+            double due = now;
+            if (endBytes < record.value)
+            {
+                // the end diverged from the recording and sent less: deliver
+                // anyway once it has been quiet longer than it was then
+                double lastRead = reads > 0 ? readTimes[(reads - 1) % REPLAY_READS] : startedAt;
+                due = lastRead + record.waitUs / 1000.0 + REPLAY_STALL_MS;
+            }
+            else if (realTime)
+            {
+                double gateAt = startedAt;
+                if (record.value > 0)
+                {
+                    // the read that reached the recorded count, or the oldest one remembered
+                    int oldest = reads > REPLAY_READS ? reads - REPLAY_READS : 0;
+                    int i = oldest;
+                    while (i < reads - 1 && readCounts[i % REPLAY_READS] < record.value)
+                        i++;
+                    gateAt = readTimes[i % REPLAY_READS] + record.waitUs / 1000.0;
+                }
+                due = gateAt;
+                if (!first && lastDeliverAt + (record.timeUs - lastTimeUs) / 1000.0 > due)
+                    due = lastDeliverAt + (record.timeUs - lastTimeUs) / 1000.0;
+            }
+
+            if (due > now)
+            {
+                timeout = (int)(due - now) + 1;
+            }
+            else
+            {
+                int written = write(fd, data + offset, record.size - offset);
+                if (written > 0)
+                    offset += written;
+
+                if (offset < record.size)
+                {
+                    fds[0].events |= POLLOUT;
+                }
+                else
+                {
+                    pending = FALSE;
+                    first = FALSE;
+                    lastDeliverAt = now;
+                    lastTimeUs = record.timeUs;
+                    deliveries++;
+                    continue;
+                }
+            }
+        }
+
+        if (poll(fds, 2, timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            result = -1;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int bytes = read(fd, buf, BUF_SIZE);
+            if (bytes > 0)
+            {
+                if (!started)
+                {
+                    started = TRUE;
+                    startedAt = channelNow();
+                }
+                endBytes += bytes;
+                readCounts[reads % REPLAY_READS] = endBytes;
+                readTimes[reads % REPLAY_READS] = channelNow();
+                reads++;
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            int fromStdin = read(STDIN_FILENO, rxStdin, sizeof(rxStdin) - 1);
+            if (fromStdin <= 0)
+            {
+                fds[1].fd = -1;
+                continue;
+            }
+            rxStdin[fromStdin - 1] = '\0';
+
+            if (strcmp(rxStdin, "start") == 0 && !started)
+            {
+                printf("REPLAY STARTED\n");
+                started = TRUE;
+                startedAt = channelNow();
+            }
+            else if (strcmp(rxStdin, "end") == 0)
+            {
+                printf("END OF THE PROGRAM\n");
+                break;
+            }
+        }
+    }
+
+    printf("Replayed %llu deliveries with %llu flipped bits, the end sent %llu bytes\n",
+           deliveries, flips, endBytes);
+    return result < 0 ? -1 : 0;
 }
 
 int main(int argc, char *argv[])
 {
+    ChannelConfig config;
+    memset(&config, 0, sizeof(config));
+    config.bitErrorRate = NOISE_BIT_ERROR_RATE;
+    config.seed = 1;
+    int noiseGiven = FALSE;
+    const char *recordPath = NULL;
+    const char *replayPath = NULL;
+    int replayEnd = -1;
+    int realTime = FALSE;
+
+    int option;
+    while ((option = getopt(argc, argv, "e:g:d:j:b:s:w:r:x:th")) != -1)
+    {
+        switch (option)
+        {
+        case 'e':
+            config.bitErrorRate = atof(optarg);
+            noiseGiven = TRUE;
+            break;
+        case 'g':
+            if (sscanf(optarg, "%lf,%lf,%lf", &config.burstStart, &config.burstEnd, &config.burstErrorRate) != 3)
+            {
+                printUsage(argv[0]);
+                exit(-1);
+            }
+            if (!noiseGiven)
+                config.bitErrorRate = 0;
+            noiseGiven = TRUE;
+            break;
+        case 'd':
+            config.delayMs = atoi(optarg);
+            break;
+        case 'j':
+            config.jitterMs = atoi(optarg);
+            break;
+        case 'b':
+            config.baudRate = atoi(optarg);
+            break;
+        case 's':
+            config.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            recordPath = optarg;
+            break;
+        case 'r':
+            replayPath = optarg;
+            break;
+        case 'x':
+            replayEnd = strcmp(optarg, "tx") == 0 ? END_TX : strcmp(optarg, "rx") == 0 ? END_RX : -1;
+            break;
+        case 't':
+            realTime = TRUE;
+            break;
+        default:
+            printUsage(argv[0]);
+            exit(option == 'h' ? 0 : -1);
+        }
+    }
+
+    Trace replay;
+    if (replayPath != NULL)
+    {
+        if (replayEnd < 0 || recordPath != NULL)
+        {
+            printUsage(argv[0]);
+            exit(-1);
+        }
+        if (traceOpen(&replay, replayPath, &config) != 0)
+        {
+            fprintf(stderr, "Cannot read trace %s\n", replayPath);
+            exit(-1);
+        }
+    }
+
+    if (recordPath != NULL && traceCreate(&trace, recordPath, &config) != 0)
+    {
+        perror(recordPath);
+        exit(-1);
+    }
+
     printf("\n");
 
     system("socat -dd PTY,link=/dev/ttyS10,mode=777 PTY,link=/dev/emulatorTx,mode=777 &");
@@ -77,12 +444,16 @@ int main(int argc, char *argv[])
            "Transmitter must open /dev/ttyS10\n"
            "Receiver must open /dev/ttyS11\n"
            "\n"
+           "Channel: bit error rate %g, bursts %g/%g at %g, delay %d ms + %d ms jitter, %d baud\n"
+           "\n"
            "The cable program is sensible to the following interactive commands:\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- noise        : add fixed noise to the cable\n"
+           "--- noise        : add bit errors to the cable\n"
            "--- end          : terminate the program\n"
-           "\n");
+           "\n",
+           config.bitErrorRate, config.burstStart, config.burstEnd, config.burstErrorRate,
+           config.delayMs, config.jitterMs, config.baudRate);
 
     // Configure serial ports
     struct termios oldtioTx;
@@ -111,79 +482,98 @@ int main(int argc, char *argv[])
     int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
-    unsigned char tx2rx[BUF_SIZE] = {0};
-    unsigned char rx2tx[BUF_SIZE] = {0};
-    char rxStdin[BUF_SIZE] = {0};
+    if (replayPath != NULL)
+    {
+        printf("Replaying %s to the %s end %s, the recorded channel was as above.\n"
+               "Type \"start\" if that end does not send first.\n",
+               replayPath, replayEnd == END_TX ? "Tx" : "Rx", realTime ? "in real time" : "at full speed");
+        int result = replayTrace(&replay, replayEnd == END_TX ? fdTx : fdRx, replayEnd, realTime);
+        traceClose(&replay);
+        system("killall socat");
+        return result;
+    }
 
-    CableMode cableMode = CableModeOn;
+    channelInit(&tx2rx, &config);
+    config.seed++;
+    channelInit(&rx2tx, &config);
+    if (recordPath != NULL)
+    {
+        channelObserve(&tx2rx, recordFlip, recordDeliver, (void *)&directions[TRACE_TX_TO_RX]);
+        channelObserve(&rx2tx, recordFlip, recordDeliver, (void *)&directions[TRACE_RX_TO_TX]);
+    }
+
+    char rxStdin[256] = {0};
+
+    CableMode cableMode;
+    changeMode(&cableMode, noiseGiven ? CableModeNoise : CableModeOn);
     volatile int STOP = FALSE;
 
     printf("Cable ready\n");
 
+    struct pollfd fds[3];
+    fds[0].fd = fdTx;
+    fds[1].fd = fdRx;
+    fds[2].fd = STDIN_FILENO;
+    fds[2].events = POLLIN;
+
     while (STOP == FALSE)
     {
-        // Read from Tx
-        int bytesFromTx = read(fdTx, tx2rx, BUF_SIZE);
+        // Deliver what is due and sleep until the next delivery or input
+        double now = channelNow();
+        int timeout = earliest(channelDeliver(&tx2rx, fdRx, now),
+                               channelDeliver(&rx2tx, fdTx, now));
 
-        if (bytesFromTx > 0)
-        {
-            if (cableMode == CableModeOff)
-            {
-                printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFromTx);
-            }
-            else
-            {
-                if (cableMode == CableModeNoise)
-                {
-                    addNoiseToBuffer(tx2rx, 0);
-                }
+        // A full channel stops reading until it drains
+        fds[0].events = channelRoom(&tx2rx) > 0 ? POLLIN : 0;
+        fds[1].events = channelRoom(&rx2tx) > 0 ? POLLIN : 0;
 
-                int bytesToRx = write(fdRx, tx2rx, bytesFromTx);
-                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
-            }
+        if (poll(fds, 3, timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
         }
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, rx2tx, BUF_SIZE);
-
-        if (bytesFromRx > 0)
+        if ((fds[0].revents | fds[1].revents) & (POLLERR | POLLHUP | POLLNVAL))
         {
-            if (cableMode == CableModeOff)
-            {
-                printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFromRx);
-            }
-            else
-            {
-                if (cableMode == CableModeNoise)
-                {
-                    addNoiseToBuffer(rx2tx, 0);
-                }
-
-                int bytesToTx = write(fdTx, rx2tx, bytesFromRx);
-                printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
-            }
+            printf("Emulator serial port closed\n");
+            break;
         }
 
+        if (fds[0].revents & POLLIN)
+            forward(fdTx, &tx2rx, cableMode, END_TX);
+        if (fds[1].revents & POLLIN)
+            forward(fdRx, &rx2tx, cableMode, END_RX);
+
+        if (fds[2].revents == 0)
+            continue;
+
         // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+        int fromStdin = read(STDIN_FILENO, rxStdin, sizeof(rxStdin) - 1);
+        if (fromStdin == 0)
+        {
+            // stdin closed, keep forwarding until killed
+            fds[2].fd = -1;
+        }
+        else if (fromStdin > 0)
         {
             rxStdin[fromStdin - 1] = '\0';
 
             if (strcmp(rxStdin, "off") == 0 || strcmp(rxStdin, "0") == 0)
             {
                 printf("CONNECTION OFF\n");
-                cableMode = CableModeOff;
+                changeMode(&cableMode, CableModeOff);
             }
             else if (strcmp(rxStdin, "on") == 0 || strcmp(rxStdin, "1") == 0)
             {
                 printf("CONNECTION ON\n");
-                cableMode = CableModeOn;
+                changeMode(&cableMode, CableModeOn);
             }
             else if (strcmp(rxStdin, "noise") == 0 || strcmp(rxStdin, "2") == 0)
             {
                 printf("CONNECTION NOISE\n");
-                cableMode = CableModeNoise;
+                changeMode(&cableMode, CableModeNoise);
             }
             else if (strcmp(rxStdin, "end") == 0)
             {
@@ -209,6 +599,12 @@ int main(int argc, char *argv[])
     close(fdTx);
     close(fdRx);
 
+    if (recordPath != NULL)
+    {
+        printf("Recorded %llu events to %s\n", trace.records, recordPath);
+        traceClose(&trace);
+    }
+
     system("killall socat");
 
     return 0;
@@ -0,0 +1,192 @@
+// Channel model for the virtual cable and the benchmark.
+
+#include "channel.h"
+
+#include <math.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+double channelNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+// xorshift64*: uniform in (0, 1)
+double channelRandom(Channel *channel)
+{
+    channel->rng ^= channel->rng >> 12;
+    channel->rng ^= channel->rng << 25;
+    channel->rng ^= channel->rng >> 27;
+    return ((channel->rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0) + 1e-300;
+}
+
+// Errors are independent within a state, so the gap to the next one is geometric.
+double channelGap(Channel *channel, double probability)
+{
+    if (probability <= 0)
+        return INFINITY;
+    return floor(-log(channelRandom(channel)) / probability);
+}
+
+void channelNextError(Channel *channel)
+{
+    channel->bitsToError = channelGap(channel, channel->burst ? channel->config.burstErrorRate
+                                                              : channel->config.bitErrorRate);
+}
+
+void channelNextState(Channel *channel)
+{
+    channel->bitsInState = channelGap(channel, channel->burst ? channel->config.burstEnd
+                                                              : channel->config.burstStart) + 1;
+}
+
+void channelInit(Channel *channel, const ChannelConfig *config)
+{
+    memset(channel, 0, sizeof(*channel));
+    channel->config = *config;
+    channel->noise = 1;
+    channel->rng = config->seed != 0 ? config->seed : 0x9E3779B97F4A7C15ULL;
+    channelNextState(channel);
+    channelNextError(channel);
+}
+
+void channelSetNoise(Channel *channel, int noise)
+{
+    channel->noise = noise;
+}
+
+void channelObserve(Channel *channel, void (*onFlip)(void *, unsigned long long),
+                    void (*onDeliver)(void *, const unsigned char *, int), void *observer)
+{
+    channel->onFlip = onFlip;
+    channel->onDeliver = onDeliver;
+    channel->observer = observer;
+}
+
+// Flips bits of data as the channel goes through size bytes.
+void channelAddErrors(Channel *channel, unsigned char *data, int size)
+{
+    double position = 0;
+    double end = size * 8.0;
+
+    while (position < end)
+    {
+        double span = end - position;
+        if (channel->bitsInState < span)
+            span = channel->bitsInState;
+
+        if (channel->bitsToError < span)
+        {
+            int bit = (int)(position + channel->bitsToError);
+            data[bit / 8] ^= 1 << (bit % 8);
+            channel->flips++;
+            if (channel->onFlip != NULL)
+                channel->onFlip(channel->observer, channel->bytes * 8 + bit);
+            position += channel->bitsToError + 1;
+            channel->bitsInState -= channel->bitsToError + 1;
+            channelNextError(channel);
+        }
+        else
+        {
+            position += span;
+            channel->bitsToError -= span;
+            channel->bitsInState -= span;
+        }
+
+        if (channel->bitsInState <= 0)
+        {
+            channel->burst = !channel->burst;
+            channelNextState(channel);
+            channelNextError(channel);
+        }
+    }
+}
+
+int channelRoom(const Channel *channel)
+{
+    return (CHANNEL_QUEUE_SIZE - channel->count) * CHANNEL_PIECE_SIZE;
+}
+
+int channelPush(Channel *channel, const unsigned char *buf, int size, double nowMs)
+{
+    int pushed = 0;
+
+    if (channel->lineFreeAt < nowMs)
+        channel->lineFreeAt = nowMs;
+
+    while (pushed < size && channel->count < CHANNEL_QUEUE_SIZE)
+    {
+        ChannelPiece *piece = &channel->queue[(channel->head + channel->count) % CHANNEL_QUEUE_SIZE];
+        piece->size = size - pushed < CHANNEL_PIECE_SIZE ? size - pushed : CHANNEL_PIECE_SIZE;
+        memcpy(piece->data, buf + pushed, piece->size);
+        if (channel->noise)
+            channelAddErrors(channel, piece->data, piece->size);
+
+        if (channel->config.baudRate > 0)
+            channel->lineFreeAt += piece->size * 10000.0 / channel->config.baudRate;
+        piece->deliverAt = channel->lineFreeAt + channel->config.delayMs;
+        if (channel->config.jitterMs > 0)
+            piece->deliverAt += channelRandom(channel) * channel->config.jitterMs;
+        if (piece->deliverAt < channel->lastDeliverAt)
+            piece->deliverAt = channel->lastDeliverAt;
+        channel->lastDeliverAt = piece->deliverAt;
+
+        channel->count++;
+        channel->bytes += piece->size;
+        pushed += piece->size;
+    }
+    return pushed;
+}
+
+int channelDeliver(Channel *channel, int fd, double nowMs)
+{
+    while (channel->count > 0)
+    {
+        // every piece that is due goes out in one writev
+        struct iovec iov[CHANNEL_WRITE_PIECES];
+        int iovcnt = 0;
+        int due = 0;
+
+        while (iovcnt < CHANNEL_WRITE_PIECES && iovcnt < channel->count)
+        {
+            ChannelPiece *piece = &channel->queue[(channel->head + iovcnt) % CHANNEL_QUEUE_SIZE];
+            if (piece->deliverAt > nowMs)
+                break;
+            iov[iovcnt].iov_base = piece->data;
+            iov[iovcnt].iov_len = piece->size;
+            due += piece->size;
+            iovcnt++;
+        }
+
+        if (iovcnt == 0)
+            return (int)ceil(channel->queue[channel->head].deliverAt - nowMs);
+
+        int result = writev(fd, iov, iovcnt);
+        int written = result > 0 ? result : 0;
+
+        while (written > 0)
+        {
+            ChannelPiece *piece = &channel->queue[channel->head];
+            if (channel->onDeliver != NULL)
+                channel->onDeliver(channel->observer, piece->data, written < piece->size ? written : piece->size);
+            if (written < piece->size)
+            {
+                memmove(piece->data, piece->data + written, piece->size - written);
+                piece->size -= written;
+                break;
+            }
+            written -= piece->size;
+            channel->head = (channel->head + 1) % CHANNEL_QUEUE_SIZE;
+            channel->count--;
+        }
+
+        // the other end is not reading, try the rest again soon
+        if (result < due)
+            return 1;
+    }
+    return -1;
+}
@@ -0,0 +1,78 @@
+// Channel model for the virtual cable and the benchmark.
+// One Channel is one direction of the line: bytes pushed into it come out
+// after the serialization time at the configured baud rate plus the
+// propagation delay and jitter, in order, with bits flipped at the
+// configured error rate. With burstStart set, errors follow a
+// Gilbert-Elliott model: the line alternates between a good state with
+// bitErrorRate and a bad state with burstErrorRate.
+
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#define CHANNEL_PIECE_SIZE 64     // bytes delivered together
+#define CHANNEL_QUEUE_SIZE 4096   // pieces in flight per direction
+#define CHANNEL_WRITE_PIECES 64   // pieces written with one call
+
+typedef struct
+{
+    double bitErrorRate;   // probability of each bit being flipped (good state)
+    double burstErrorRate; // probability of each bit being flipped in the bad state
+    double burstStart;     // probability per bit of entering the bad state, 0 for no bursts
+    double burstEnd;       // probability per bit of leaving the bad state
+    int delayMs;           // propagation delay
+    int jitterMs;          // extra delay, uniform in [0, jitterMs]
+    int baudRate;          // line rate, 10 bits per byte; 0 for unlimited
+    unsigned long long seed;
+} ChannelConfig;
+
+typedef struct
+{
+    double deliverAt; // ms
+    int size;
+    unsigned char data[CHANNEL_PIECE_SIZE];
+} ChannelPiece;
+
+typedef struct
+{
+    ChannelConfig config;
+    ChannelPiece queue[CHANNEL_QUEUE_SIZE];
+    int head;
+    int count;
+    double lineFreeAt;     // ms when the last queued byte is on the line
+    double lastDeliverAt;  // jitter never reorders bytes
+    int noise;             // add bit errors
+    int burst;             // in the bad state
+    double bitsInState;    // bits left before the next state change
+    double bitsToError;    // bits left before the next flipped bit
+    unsigned long long rng;
+    unsigned long long bytes;
+    unsigned long long flips;
+    // optional hooks, called with observer
+    void (*onFlip)(void *observer, unsigned long long bit); // bit position in the pushed stream
+    void (*onDeliver)(void *observer, const unsigned char *data, int size);
+    void *observer;
+} Channel;
+
+// Milliseconds on CLOCK_MONOTONIC.
+double channelNow(void);
+
+// Starts with noise on.
+void channelInit(Channel *channel, const ChannelConfig *config);
+
+void channelSetNoise(Channel *channel, int noise);
+
+void channelObserve(Channel *channel, void (*onFlip)(void *, unsigned long long),
+                    void (*onDeliver)(void *, const unsigned char *, int), void *observer);
+
+// Bytes the channel can take now.
+int channelRoom(const Channel *channel);
+
+// Queues up to size bytes that were read at nowMs, adding errors.
+// Returns the number of bytes queued.
+int channelPush(Channel *channel, const unsigned char *buf, int size, double nowMs);
+
+// Writes every piece due by nowMs to fd, which should be non-blocking.
+// Returns the ms until the next piece is due, or -1 if nothing is queued.
+int channelDeliver(Channel *channel, int fd, double nowMs);
+
+#endif // _CHANNEL_H_
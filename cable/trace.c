@@ -0,0 +1,85 @@
+// Binary trace of the cable traffic.
+
+#include "trace.h"
+
+#include <string.h>
+
+int traceCreate(Trace *trace, const char *path, const ChannelConfig *config)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->file = fopen(path, "wb");
+    if (trace->file == NULL)
+        return -1;
+
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.config = *config;
+
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1)
+    {
+        fclose(trace->file);
+        trace->file = NULL;
+        return -1;
+    }
+    trace->startMs = channelNow();
+    return 0;
+}
+
+int traceOpen(Trace *trace, const char *path, ChannelConfig *config)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->file = fopen(path, "rb");
+    if (trace->file == NULL)
+        return -1;
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, trace->file) != 1 || header.magic != TRACE_MAGIC)
+    {
+        fclose(trace->file);
+        trace->file = NULL;
+        return -1;
+    }
+    *config = header.config;
+    return 0;
+}
+
+void traceWrite(Trace *trace, TraceType type, int direction, unsigned long long value,
+                unsigned int waitUs, const unsigned char *data, unsigned int size, double nowMs)
+{
+    if (trace->file == NULL)
+        return;
+
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.timeUs = (unsigned long long)((nowMs - trace->startMs) * 1000);
+    record.value = value;
+    record.size = size;
+    record.waitUs = waitUs;
+    record.type = type;
+    record.direction = direction;
+
+    fwrite(&record, sizeof(record), 1, trace->file);
+    if (size > 0)
+        fwrite(data, 1, size, trace->file);
+    trace->records++;
+}
+
+int traceRead(Trace *trace, TraceRecord *record, unsigned char *data, unsigned int capacity)
+{
+    if (fread(record, sizeof(*record), 1, trace->file) != 1)
+        return feof(trace->file) ? 0 : -1;
+
+    if (record->size > capacity || fread(data, 1, record->size, trace->file) != record->size)
+        return -1;
+
+    trace->records++;
+    return 1;
+}
+
+void traceClose(Trace *trace)
+{
+    if (trace->file != NULL)
+        fclose(trace->file);
+    trace->file = NULL;
+}
@@ -0,0 +1,68 @@
+// Binary trace of the cable traffic, for record and replay.
+// A trace is a TraceHeader followed by TraceRecords, each followed by size
+// bytes of data. Directions are TRACE_TX_TO_RX and TRACE_RX_TO_TX.
+// Values are in the byte order of the machine that recorded them.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+
+#include "channel.h"
+
+#define TRACE_MAGIC 0x31544243 // "CBT1"
+
+#define TRACE_TX_TO_RX 0
+#define TRACE_RX_TO_TX 1
+
+typedef enum
+{
+    TraceRead,    // value: bytes read from the sending end so far
+    TraceDeliver, // data written to the receiving end; value: bytes read from
+                  // the receiving end so far, waitUs: time since its last read
+    TraceFlip,    // value: position of the flipped bit in the direction's stream
+    TraceMode,    // value: new cable mode
+} TraceType;
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int reserved;
+    ChannelConfig config;
+} TraceHeader;
+
+typedef struct
+{
+    unsigned long long timeUs; // since the start of the recording
+    unsigned long long value;
+    unsigned int size;
+    unsigned int waitUs;
+    unsigned char type;
+    unsigned char direction;
+} TraceRecord;
+
+typedef struct
+{
+    FILE *file;
+    double startMs;
+    unsigned long long records;
+} Trace;
+
+// Creates a trace at path for writing. Returns 0 on success, -1 on error.
+int traceCreate(Trace *trace, const char *path, const ChannelConfig *config);
+
+// Opens the trace at path for reading and fills config from its header.
+// Returns 0 on success, -1 on error.
+int traceOpen(Trace *trace, const char *path, ChannelConfig *config);
+
+// Appends a record with size bytes of data, timed at nowMs.
+void traceWrite(Trace *trace, TraceType type, int direction, unsigned long long value,
+                unsigned int waitUs, const unsigned char *data, unsigned int size, double nowMs);
+
+// Reads the next record and its data, which must fit in capacity bytes.
+// Returns 1 on success, 0 at the end of the trace, -1 on error.
+int traceRead(Trace *trace, TraceRecord *record, unsigned char *data, unsigned int capacity);
+
+void traceClose(Trace *trace);
+
+#endif // _TRACE_H_
@@ -5,21 +5,49 @@
 #define _APPLICATION_LAYER_H_
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
+
+#include "macros.h"
+
+typedef struct
+{
+    unsigned char *data;
+    int size;
+} PacketBuffer;
+
+// Ring of TX_POOL_SIZE packet buffers between the file reader and llwrite.
+typedef struct
+{
+    FILE *file;
+    long int filesize;
+    PacketBuffer pool[TX_POOL_SIZE];
+    int head;        // next packet to send
+    int tail;        // next buffer to fill
+    int count;       // filled buffers
+    int done;        // reader reached the end of the file
+    int stop;        // sender gave up, so the reader quits
+    int payloadSize; // packet size the reader should build next
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} TxPipeline;
 
 // Application layer main function.
 // Arguments:
-//   serialPort: Serial port name (e.g., /dev/ttyS0).
+//   serialPort: Serial port name (e.g., /dev/ttyS0), or several separated by
+//               commas to stripe the transfer across them (see bonding.h).
 //   role: Application role {"tx", "rx"}.
 //   baudrate: Baudrate of the serial port.
 //   nTries: Maximum number of frame retries.
-//   timeout: Frame timeout.
+//   timeout: Frame timeout (ms).
 //   filename: Name of the file to send / receive.
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename);
 
 long int findFileSize(FILE *file);
 
-unsigned char *buildControlPacket(const char *filename, long int filesize, unsigned int *length);
+// links > 1 announces a bonded transfer (see bonding.h).
+unsigned char *buildControlPacket(const char *filename, long int filesize, int compressed, int links, unsigned int *length);
 
 void buildDataPacket(FILE* file, unsigned char *dataPacket, int dataSize, unsigned char identifier);
 
@@ -27,6 +55,22 @@ long int extractFileSize(unsigned char* packet);
 
 unsigned char* extractFileName(unsigned char* packet);
 
+int extractCompression(unsigned char* packet, int size);
+
+int extractLinks(unsigned char* packet, int size);
+
 void extractData(unsigned char* packet, unsigned char* buffer, int datasize);
 
+void *fileReaderThread(void *arg);
+
+void *compressingReaderThread(void *arg);
+
+int sendFileData(FILE *file, long int filesize, int compressed, int fd);
+
+unsigned char *mapFile(FILE *file, long int filesize);
+
+int sendFileMapped(const unsigned char *map, long int filesize, int fd);
+
+long int receiveFileData(const char *filename, long int filesize, int compressed, int fd);
+
 #endif // _APPLICATION_LAYER_H_
@@ -0,0 +1,73 @@
+// Link bonding header.
+// Stripes one transfer across several serial lines between the same hosts.
+// The port argument lists them comma separated, e.g. "/dev/ttyS10,/dev/ttyS12",
+// and both ends must list the lines in the same order. Every line has its own
+// connection and sender thread, which takes the next slice of the file
+// whenever its window has room, so each line carries a share that follows its
+// throughput. Bonded data packets carry their file offset, and the receiver
+// puts each one in place whatever line it came on.
+
+#ifndef _BONDING_H_
+#define _BONDING_H_
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "link_layer.h"
+#include "macros.h"
+
+// Bonded data packet: [5, N, L2, L1, offset (4 bytes, big endian), data]
+#define BOND_DATA_PACKET 5
+#define BOND_HEADER_SIZE 8
+
+// The file and how much of it was handed out, shared by the lines.
+typedef struct
+{
+    FILE *file;
+    unsigned char *map;   // whole file; TX reads with pread when NULL
+    long int filesize;
+    long int offset;      // next byte a sender takes
+    int failed;           // a line died, so the others stop taking slices
+    pthread_mutex_t lock;
+    const unsigned char *endPacket;
+    unsigned int endLength;
+} BondStripe;
+
+typedef struct
+{
+    LinkLayer params;
+    int fd;
+    BondStripe *stripe;
+    long int bytes; // file bytes this line carried
+    int result;
+} BondLine;
+
+// Splits a comma separated list into at most maxPorts names.
+// Return the number of names or "-1" if there are too many or one is too long.
+int splitPortList(const char *list, char ports[][50], int maxPorts);
+
+// Runs llopen on every line at once, so the order the other end answers in
+// does not matter. Return "0" if all of them opened.
+int openBondedLines(BondLine *lines, int count);
+
+// Runs llclose on every line that is open.
+// Return "0" if all of them closed cleanly.
+int closeBondedLines(BondLine *lines, int count, int showStatistics);
+
+void *bondOpenThread(void *arg);
+
+void *bondSenderThread(void *arg);
+
+void *bondReceiverThread(void *arg);
+
+// Return "0" on success or "-1" on error.
+int sendFileBonded(BondLine *lines, int count, BondStripe *stripe);
+
+// Return the number of bytes written or "-1" on error.
+long int receiveFileBonded(BondLine *lines, int count, const char *filename, long int filesize);
+
+// The whole transfer over count lines, for the role in params.
+// Return "0" on success or "-1" on error.
+int bondedApplication(const LinkLayer *params, char ports[][50], int count, const char *filename);
+
+#endif // _BONDING_H_
@@ -0,0 +1,18 @@
+// Data packet compression header.
+// LZ77 blocks in the LZ4 block format: each block decodes on its own.
+
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+// Largest input block; its size travels in 2 bytes
+#define COMPRESS_MAX_INPUT 65535
+
+// Compresses size bytes of in into out, which holds capacity bytes.
+// Returns the compressed size, or "-1" if it does not fit.
+int compressBlock(const unsigned char *in, int size, unsigned char *out, int capacity);
+
+// Decompresses a block of size bytes into out, which holds capacity bytes.
+// Returns the decompressed size, or "-1" if the block is malformed or too large.
+int decompressBlock(const unsigned char *in, int size, unsigned char *out, int capacity);
+
+#endif // _COMPRESSION_H_
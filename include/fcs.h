@@ -0,0 +1,32 @@
+// Frame check sequence header.
+
+#ifndef _FCS_H_
+#define _FCS_H_
+
+#include <stdint.h>
+
+typedef enum
+{
+    FcsXor,   // 1 byte, XOR of the payload (original BCC2)
+    FcsCrc16, // 2 bytes, CRC-16-CCITT as used by HDLC (X.25)
+    FcsCrc32, // 4 bytes, CRC-32 (IEEE 802.3)
+} FcsType;
+
+// Builds the CRC lookup tables. Safe to call more than once, from any thread.
+void fcsTablesInit(void);
+
+// Number of bytes the check sequence takes in the frame.
+int fcsSize(FcsType type);
+
+uint32_t fcsInit(FcsType type);
+
+// Runs size bytes of buf through the check.
+uint32_t fcsUpdate(FcsType type, uint32_t fcs, const unsigned char *buf, int size);
+
+// Writes the fcsSize(type) bytes that go after the payload.
+void fcsFinal(FcsType type, uint32_t fcs, unsigned char *out);
+
+// Return "1" if fcs, updated over payload and check bytes, shows no error.
+int fcsCheck(FcsType type, uint32_t fcs);
+
+#endif // _FCS_H_
@@ -0,0 +1,40 @@
+// Forward error correction header.
+// Reed-Solomon over GF(256): a frame is split into blocks of at most
+// FEC_BLOCK_DATA bytes, each followed on the line by FEC_PARITY_SIZE parity
+// bytes that repair up to FEC_PARITY_SIZE / 2 wrong bytes in it. Bytes are
+// dealt to the blocks in turn, so a burst of errors is spread over all of them.
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+#define FEC_PARITY_SIZE 16
+#define FEC_BLOCK_DATA (255 - FEC_PARITY_SIZE)
+
+typedef struct
+{
+    unsigned char *parity; // FEC_PARITY_SIZE bytes per block
+    int blocks;
+    int position; // data bytes encoded so far
+} FecEncoder;
+
+// Builds the Galois field and generator tables. Safe to call more than once, from any thread.
+void fecTablesInit(void);
+
+// Number of parity bytes that protect size bytes of data.
+int fecParitySize(int size);
+
+// Size of the data in a frame of frameSize bytes, parity included, or "-1"
+// if no data size gives that length.
+int fecDataSize(int frameSize);
+
+// Starts the parity of size bytes of data in parity, which holds fecParitySize(size) bytes.
+void fecEncoderInit(FecEncoder *encoder, int size, unsigned char *parity);
+
+// Runs the next size bytes of data through the encoder.
+void fecEncode(FecEncoder *encoder, const unsigned char *buf, int size);
+
+// Repairs size bytes of data in place against the parity fecEncode wrote for them.
+// Returns the number of bytes corrected, or "-1" if a block has more errors than it can fix.
+int fecDecode(unsigned char *data, int size, const unsigned char *parity);
+
+#endif // _FEC_H_
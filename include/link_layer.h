@@ -12,7 +12,11 @@
 #include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
-#include <signal.h>
+#include <poll.h>
+
+#include "fcs.h"
+#include "stuffing.h"
+#include "transport.h"
 
 typedef enum
 {
@@ -20,58 +24,115 @@ typedef enum
     LlRx,
 } LinkLayerRole;
 
+typedef enum
+{
+    ArqGoBackN,
+    ArqSelectiveRepeat,
+} ArqMode;
+
 typedef struct
 {
     char serialPort[50];
     LinkLayerRole role;
     int baudRate;
     int nRetransmissions;
-    int timeout;
+    int timeout; // ms
+    int windowSize;
+    ArqMode arqMode;
+    FcsType fcsType;
+    int maxPayloadSize;
+    int compression;
+    int duplex;              // offer full duplex, see llopen
+    int fec;                 // offer forward error correction, see llopen
+    char statisticsFile[50]; // JSON statistics written here at llclose, "" for none
+    TransportType transport; // how serialPort is opened, see transport.h
 } LinkLayer;
 
-typedef enum
+typedef struct
 {
-    START,
-    FLAG_RCV,
-    A_RCV,
-    C_RCV,
-    BCC_OK,
-    READING_RCV,
-    ESCAPE_RCV,
-    STOP,
-} llMachineState;
+    long long framesSent;      // I-frames, first transmissions only
+    long long framesReceived;  // I-frames delivered in sequence
+    long long retransmissions; // I-frames sent again
+    long long rejects;         // REJ/SREJ sent (RX) or received (TX)
+    long long timeouts;        // retransmission timer expirations
+    long long duplicates;      // I-frames received again and discarded
+    long long badFrames;       // I-frames that failed the FCS
+    long long fecFrames;       // I-frames sent or received with FEC parity
+    long long fecCorrected;    // I-frames FEC repaired instead of a retransmission
+    long long stuffedBytes;    // escape bytes added (TX) or removed (RX)
+    long long payloadBytes;    // data acknowledged (TX) or delivered (RX)
+    long long lineBytesSent;
+    long long lineBytesReceived;
+    long long handshakeMs;     // SET/UA exchange
+    long long transferMs;      // from the end of llopen to llclose
+} LinkStatistics;
 
 // Open a connection using the "port" parameters defined in struct linkLayer.
-// Return "1" on success or "-1" on error.
+// Up to MAX_CONNECTIONS can be open at once. Calls on different connections
+// may run in parallel threads; calls on the same one are serialized.
+// If both ends offer duplex, both may llwrite and llread, and one thread may
+// wait in llwrite while another waits in llread on the same connection.
+// The roles then only decide who starts llopen and llclose.
+// If both ends offer FEC, I-frames carry Reed-Solomon parity while the
+// frame error rate is high, and llread repairs a bounded number of bad bytes
+// in a frame instead of asking for it again.
+// Return the descriptor passed to the other ll* calls, or "-1" on error.
 int llopen(LinkLayer connectionParameters);
 
 // Send data in buf with size bufSize.
+// The frame is queued in the sliding window; the call only blocks while
+// the window is full.
 // Return number of chars written, or "-1" on error.
 int llwrite(const unsigned char *buf, int bufSize, int fd);
 
+// Send data gathered from iov without copying it. The memory stays in use
+// for retransmissions and must not change until llclose returns.
+// Only clean runs of at least STUFF_REF_MIN bytes are referenced and no run
+// spans two entries, so an entry shorter than that is always copied and may
+// live on the caller's stack (a packet header, say).
+// Return number of chars written, or "-1" on error.
+int llwritev(const struct iovec *iov, int iovcnt, int fd);
+
 // Receive data in packet.
-// Return number of chars read, or "-1" on error.
+// Return number of chars read, "0" if the frame was dropped or asked for
+// again, or "-1" once the connection failed, e.g. the line hung up.
 int llread(unsigned char *packet, int fd);
 
-// Close previously opened connection.
-// if showStatistics == TRUE, link layer should print statistics in the console on close.
-// Return "1" on success or "-1" on error.
-int llclose(int fd, LinkLayer connectionParameters);
+// Receive data without an intermediate copy: the first headerSize bytes go
+// to header and the rest straight to data, which holds dataCapacity bytes.
+// Returns like llread.
+int llreadinto(unsigned char *header, int headerSize, unsigned char *data, int dataCapacity, int fd);
+
+// Largest buffer llwrite accepts and llread may return, agreed at llopen.
+int llmaxpayload(int fd);
 
-int serialPortConnection(LinkLayer connectionParameters);
+// Payload size expected to give the best throughput at the frame error
+// rate measured so far, between MIN_ADAPTIVE_PAYLOAD and llmaxpayload().
+int lloptimalpayload(int fd);
 
-void alarmHandler(int signal);
+// Return "1" if both ends agreed at llopen to compress data packets.
+int llcompression(int fd);
 
-int sendFrame(int fd, unsigned char adress, unsigned char control);
+// Return "1" if both ends agreed at llopen to run full duplex.
+int llduplex(int fd);
 
-llMachineState tx_llopen_machinestate(int fd);
+// Return "1" if both ends agreed at llopen to use forward error correction.
+int llfec(int fd);
+
+// Close previously opened connection, once no other call on it is running.
+// if showStatistics == TRUE, link layer should print statistics in the console on close.
+// Return "1" on success or "-1" on error.
+int llclose(int fd, LinkLayer connectionParameters, int showStatistics);
 
-void rx_llopen_machinestate(int fd);
+// Counters of the connection, reset at llopen. They stay readable after
+// llclose until llopen hands out the same descriptor again.
+const LinkStatistics *llstatistics(int fd);
 
-unsigned char trama_answer_machinestate(int fd);
+double statisticsGoodput(const LinkStatistics *statistics);
 
-llMachineState tx_llclose_machinestate(int fd);
+void printStatistics(const LinkStatistics *statistics, const LinkLayer *params);
 
-void rx_llclose_machinestate(int fd);
+// Return "0" on success or "-1" if the file could not be written.
+int writeStatisticsJson(const char *path, const LinkStatistics *statistics, const LinkLayer *params);
 
 #endif // _LINK_LAYER_H_
@@ -0,0 +1,58 @@
+// Leveled logger header.
+// Messages are formatted into a lock-free ring buffer and written out by a
+// background thread, so logging never waits for the terminal. Sites above
+// LOG_COMPILED_LEVEL are compiled out; the rest are filtered at runtime by
+// logLevel, which LINK_LOG_LEVEL (error, warn, info, debug) sets at logInit.
+
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <stdatomic.h>
+
+#include "macros.h"
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#define LOG_RING_SIZE 1024   // messages, power of two
+#define LOG_MESSAGE_SIZE 128 // longer messages are truncated
+#define LOG_FLUSH_INTERVAL 20 // ms the writer sleeps when the ring is empty
+
+extern atomic_int logLevel;
+
+// Starts the writer thread; until then messages are printed directly.
+// The ring is drained at exit.
+void logInit(void);
+
+// Waits until every message logged so far has been written.
+void logFlush(void);
+
+void logShutdown(void);
+
+void logWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, ...) do { if(atomic_load_explicit(&logLevel, memory_order_relaxed) >= (level)) logWrite(level, __VA_ARGS__); } while(0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#if LOG_COMPILED_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while(0)
+#endif
+
+#if LOG_COMPILED_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while(0)
+#endif
+
+#if LOG_COMPILED_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while(0)
+#endif
+
+#endif // _LOGGER_H_
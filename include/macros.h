@@ -3,7 +3,11 @@
 
 #define BAUDRATE 9600
 #define N_TRIES 3
-#define TIMEOUT 5
+#define TIMEOUT 2000 // ms, first retransmission timeout before any RTT is measured
+
+// Bounds of the adaptive retransmission timeout (ms)
+#define MIN_RTO 20
+#define MAX_RTO 60000
 
 #define FLAG 0x7E
 #define ADRESS1 0X03
@@ -21,11 +25,125 @@
 // volatile int STOP_ = FALSE;
 
 // SIZE of maximum acceptable payload.
-// Maximum number of bytes that application layer should send to link layer
+// Maximum number of bytes that application layer should send to link layer.
+// Each side offers its own value at llopen and both use the smaller one.
 #define MAX_PAYLOAD_SIZE 1000
 
-#define NS(ns) (ns << 6)
-#define RR(nr) ((nr << 7) | 0x05)
-#define REJ(nr) ((nr << 7) | 0x01)
+// Bounds for the negotiated payload size: the start control packet must fit,
+// and data packets carry their length in 2 bytes.
+#define MIN_PAYLOAD_SIZE 512
+#define MAX_PAYLOAD_LIMIT (65535 + 4)
+
+// Smallest payload the adaptive frame length goes down to on noisy lines,
+// and the one it starts from before anything was measured
+#define MIN_ADAPTIVE_PAYLOAD 64
+#define ADAPTIVE_START_PAYLOAD 1000
+
+// Weight of each frame in the frame error rate average is 1 / FER_SMOOTHING
+#define FER_SMOOTHING 16
+
+// Packet buffers the file reader thread may fill ahead of the link layer
+#define TX_POOL_SIZE 16
+
+// Serial lines one transfer can be striped across (see bonding.h)
+#define MAX_BOND_LINES 4
+
+// Send data packets straight from a mapping of the file instead of the reader thread
+#define ZERO_COPY_TX TRUE
+
+// Per stage latency histograms of the frame pipeline (see profiler.h)
+#ifndef PROFILING
+#define PROFILING FALSE
+#endif
+
+// Most detailed log level built in (see logger.h); per-frame messages are
+// LOG_LEVEL_DEBUG and cost nothing unless built with -DLOG_COMPILED_LEVEL=3
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Print link statistics at llclose, and also write them as JSON to
+// STATISTICS_FILE unless it is ""
+#define SHOW_STATISTICS TRUE
+#define STATISTICS_FILE ""
+
+// Offer to compress data packets (see application layer)
+#define COMPRESSION FALSE
+
+// Offer full duplex: both ends send I-frames, which carry N(r) for the other
+// direction (see llopen)
+#ifndef DUPLEX
+#define DUPLEX FALSE
+#endif
+
+// Full duplex: longest an acknowledgement waits for an outgoing I-frame to
+// carry it before it is sent as an RR of its own (ms)
+#define ACK_DELAY 20
+
+// Offer forward error correction of I-frames (see fec.h)
+#ifndef FEC
+#define FEC FALSE
+#endif
+
+// With FEC agreed, I-frames carry parity once the frame error rate goes above
+// FEC_ON_FER. The rate then only counts frames FEC could not repair, so after
+// FEC_PROBE_FRAMES frames the parity is dropped to measure the bare line again.
+#define FEC_ON_FER 0.1
+#define FEC_PROBE_FRAMES 64
+
+// Frame check sequence after the payload: FcsXor, FcsCrc16 or FcsCrc32
+#define FCS_TYPE FcsCrc32
+#define MAX_FCS_SIZE 4
+
+// Largest I-frame on the line: F, A, C, BCC1, stuffed payload and FCS, F
+#define MAX_FRAME_SIZE(payload) (5 + 2 * ((payload) + MAX_FCS_SIZE))
+
+// Capabilities carried as TLVs in the information field of SET and UA
+#define CAP_MAX_PAYLOAD 0x01 // 4 bytes, big endian
+#define CAP_WINDOW 0x02      // 1 byte
+#define CAP_ARQ 0x03         // 1 byte, ArqMode
+#define CAP_FCS 0x04         // 1 byte, FcsType
+#define CAP_COMPRESSION 0x05 // 1 byte, TRUE/FALSE
+#define CAP_DUPLEX 0x06      // 1 byte, TRUE/FALSE
+#define CAP_FEC 0x07         // 1 byte, TRUE/FALSE
+#define MAX_CAPS_SIZE 64
+
+// The FCS is computed block by block right before each block is stuffed
+#define FCS_BLOCK_SIZE 256
+
+// Size of the receive buffer filled by each read() on the serial port
+#define RX_BUFFER_SIZE 4096
+
+// Connections one process can have open at once (see llopen)
+#define MAX_CONNECTIONS 64
+
+// Sequence numbers are 3 bits wide, so the sender may keep up to
+// SEQ_MODULO - 1 I-frames unacknowledged (Go-Back-N).
+#define SEQ_MODULO 8
+
+// Number of I-frames in flight. 1 behaves as stop-and-wait.
+// Selective Repeat caps it at SEQ_MODULO / 2.
+#define WINDOW_SIZE 7
+
+// Retransmission strategy: ArqGoBackN or ArqSelectiveRepeat
+#define ARQ_MODE ArqSelectiveRepeat
+
+// I-frame: N(s) in bits 1-3, bit 0 cleared, bit 4 set if FEC parity follows
+// the FCS; in full duplex N(r) in bits 5-7.
+// S-frame: N(r) in bits 5-7, type in the low bits.
+#define NS(ns) (((ns) & 0x07) << 1)
+#define FEC_FLAG 0x10
+#define PIGGYBACK(nr) (((nr) & 0x07) << 5)
+#define RR(nr) ((((nr) & 0x07) << 5) | 0x05)
+#define REJ(nr) ((((nr) & 0x07) << 5) | 0x01)
+#define SREJ(nr) ((((nr) & 0x07) << 5) | 0x0D)
+
+#define IS_IFRAME(c) (((c) & 0x01) == 0)
+#define IS_RR(c) (((c) & 0x1F) == 0x05)
+#define IS_REJ(c) (((c) & 0x1F) == 0x01)
+#define IS_SREJ(c) (((c) & 0x1F) == 0x0D)
+#define GET_NS(c) (((c) >> 1) & 0x07)
+#define HAS_FEC(c) (((c) & FEC_FLAG) != 0)
+#define GET_NR(c) (((c) >> 5) & 0x07)
 
 #endif
\ No newline at end of file
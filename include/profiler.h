@@ -0,0 +1,71 @@
+// Hot path profiler header.
+// Built only when PROFILING is set (e.g. make CFLAGS="-Wall -DPROFILING=1");
+// otherwise every PROFILE_ macro expands to nothing.
+
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include "macros.h"
+
+typedef enum
+{
+    ProfileStuffing,    // byte stuffing of I-frame payloads
+    ProfileDestuffing,  // destuffing of received I-frames
+    ProfileFcs,         // frame check sequence, both directions
+    ProfileWrite,       // write()/writev() of frames
+    ProfileRead,        // read() of the serial port
+    ProfileWaitAnswer,  // llwrite blocked until an RR/REJ arrives
+    ProfileCompression, // compressing or decompressing data packets
+    ProfileFileIo,      // application reads and writes of the file
+    ProfileFec,         // FEC parity, and repairs of frames that failed the FCS
+    PROFILE_STAGES,
+} ProfileStage;
+
+#if PROFILING
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+static inline unsigned long long profileClock(void){
+    return __rdtsc();
+}
+#else
+#include <time.h>
+static inline unsigned long long profileClock(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+#endif
+
+// Starts the clock calibration; call once before anything is recorded.
+void profileInit(void);
+
+// Adds one sample of the given clock ticks to the stage histogram. Safe from any thread.
+void profileRecord(ProfileStage stage, unsigned long long ticks);
+
+// Prints count, p50, p99, max and mean of every stage that has samples.
+void profileReport(void);
+
+#define PROFILE_INIT() profileInit()
+#define PROFILE_REPORT() profileReport()
+#define PROFILE_START(timer) unsigned long long timer = profileClock()
+#define PROFILE_STOP(stage, timer) profileRecord(stage, profileClock() - (timer))
+// Sums the time since timer into total and restarts timer, for stages that
+// interleave inside one loop; PROFILE_RECORD then adds total as one sample.
+#define PROFILE_DECLARE(total) unsigned long long total = 0
+#define PROFILE_LAP(total, timer) do { unsigned long long profileNow = profileClock(); (total) += profileNow - (timer); (timer) = profileNow; } while(0)
+#define PROFILE_RECORD(stage, total) profileRecord(stage, total)
+
+#else
+
+#define PROFILE_INIT()
+#define PROFILE_REPORT()
+#define PROFILE_START(timer)
+#define PROFILE_STOP(stage, timer)
+#define PROFILE_DECLARE(total)
+#define PROFILE_LAP(total, timer)
+#define PROFILE_RECORD(stage, total)
+
+#endif // PROFILING
+
+#endif // _PROFILER_H_
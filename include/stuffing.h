@@ -0,0 +1,78 @@
+// Byte stuffing header.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+#include <sys/uio.h>
+
+// Worst case size of size bytes once stuffed (every byte escaped).
+#define STUFFED_SIZE(size) (2 * (size))
+
+// Destuffed bytes that may go past the output buffer (trailing check bytes).
+#define DESTUFF_SPILL_SIZE 8
+
+typedef struct
+{
+    unsigned char *head; // first headSize destuffed bytes go here, the rest to out
+    int headSize;
+    unsigned char *out;
+    int capacity;
+    unsigned char spill[DESTUFF_SPILL_SIZE];
+    int size;    // destuffed bytes so far, may be larger than capacity
+    int escaped; // last input byte was an ESCAPE
+} DestuffState;
+
+// Clean runs at least this long are sent from the caller's memory instead of copied.
+#define STUFF_REF_MIN 64
+
+// Most iov entries a gathered frame with a payload of size bytes needs.
+#define GATHER_IOV_SIZE(size) (2 * ((size) / STUFF_REF_MIN) + 4)
+
+// A stuffed frame as a list for writev. Long clean runs of the payload point
+// at the caller's memory; header, escape pairs, short runs and trailer are
+// copied to bytes.
+typedef struct
+{
+    struct iovec *iov;
+    int iovcnt;
+    unsigned char *bytes;
+    int size;   // bytes used
+    int length; // frame length on the line
+} GatherFrame;
+
+// Returns the index of the first FLAG or ESCAPE in buf, or size if there is none.
+// Uses the widest vector unit available on the running CPU.
+extern int (*findSpecial)(const unsigned char *buf, int size);
+
+// Stuffs size bytes of buf into out, which must hold STUFFED_SIZE(size) bytes.
+// Returns the number of bytes written.
+int stuffBytes(const unsigned char *buf, int size, unsigned char *out);
+
+void gatherInit(GatherFrame *frame);
+
+// Appends size bytes of buf to the frame as they are.
+void gatherCopy(GatherFrame *frame, const unsigned char *buf, int size);
+
+// Appends size bytes of buf to the frame, stuffed. If reference is set, long
+// clean runs are not copied and buf must stay valid as long as the frame.
+void gatherStuff(GatherFrame *frame, const unsigned char *buf, int size, int reference);
+
+void destuffInit(DestuffState *state, unsigned char *out, int capacity);
+
+// Like destuffInit, but the first headSize bytes are written to head.
+void destuffInitSplit(DestuffState *state, unsigned char *head, int headSize, unsigned char *out, int capacity);
+
+// Destuffs in until the end of the input or a FLAG, which is not consumed.
+// Returns the number of input bytes consumed.
+int destuffBytes(DestuffState *state, const unsigned char *in, int size);
+
+// Byte at position index of the destuffed output.
+unsigned char destuffedByte(const DestuffState *state, int index);
+
+// Copies the first size destuffed bytes to dst.
+void destuffCopy(const DestuffState *state, unsigned char *dst, int size);
+
+// Return "1" if the destuffed data did not fit in the output and the spill area.
+int destuffOverflow(const DestuffState *state);
+
+#endif // _STUFFING_H_
@@ -0,0 +1,77 @@
+// Transport header.
+// The byte pipe under the link layer. Every backend exposes one descriptor
+// that poll() reports readable when read would return data, so the link
+// layer waits on it next to its retransmission timer whatever the backend.
+// The name given to transportOpen depends on the type:
+//   TransportSerial  serial port device, configured with termios at the baud rate
+//   TransportPty     pseudo terminal slave, raw mode, the baud rate is not set
+//   TransportSocket  decimal descriptor of a connected stream socket, e.g. one
+//                    end of transportSocketpair
+//   TransportMemory  name of an in-process pipe: the first open creates it,
+//                    the second one connects to it
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <sys/uio.h>
+#include <termios.h>
+
+#define MEMORY_PIPE_SIZE 65536 // bytes buffered per direction before the pipe grows
+#define MEMORY_PIPE_NAME_SIZE 50
+
+typedef enum
+{
+    TransportSerial,
+    TransportPty,
+    TransportSocket,
+    TransportMemory,
+} TransportType;
+
+typedef struct Transport Transport;
+typedef struct MemoryPipe MemoryPipe;
+
+typedef struct
+{
+    // Return "0" on success or "-1" on error.
+    int (*open)(Transport *transport, const char *name, int baudRate);
+    // Return the number of bytes read, "0" if none are available or "-1" on error.
+    int (*read)(Transport *transport, unsigned char *buf, int size);
+    // Writes everything. Return the number of bytes written or "-1" on error.
+    int (*writev)(Transport *transport, const struct iovec *iov, int iovcnt);
+    int (*close)(Transport *transport);
+} TransportOps;
+
+struct Transport
+{
+    const TransportOps *ops;
+    TransportType type;
+    int fd;                 // readable when there is data
+    struct termios oldtio;  // serial: settings restored at close
+    MemoryPipe *pipe;       // memory: shared with the other end
+    int side;               // memory: 0 created the pipe, 1 connected to it
+};
+
+// Return "0" on success or "-1" on error.
+int transportOpen(Transport *transport, TransportType type, const char *name, int baudRate);
+
+int transportRead(Transport *transport, unsigned char *buf, int size);
+
+int transportWritev(Transport *transport, const struct iovec *iov, int iovcnt);
+
+int transportWrite(Transport *transport, const unsigned char *buf, int size);
+
+// Waits up to timeoutMs (-1 forever) for data or for otherFd (-1 for none)
+// to become readable. Returns a mask of 1 for data, 2 for otherFd and 4 if
+// the other end hung up.
+int transportPoll(Transport *transport, int otherFd, int timeoutMs);
+
+int transportClose(Transport *transport);
+
+// Splits "pty:/dev/pts/3", "socket:5" or "mem:link0" into type and name.
+// Names without a prefix are serial ports.
+const char *transportParse(const char *spec, TransportType *type);
+
+// Creates two connected stream sockets for TransportSocket.
+int transportSocketpair(int fds[2]);
+
+#endif // _TRANSPORT_H_
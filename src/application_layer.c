@@ -2,8 +2,13 @@
 
 #include "application_layer.h"
 #include "link_layer.h"
+#include "bonding.h"
 #include "macros.h"
+#include "compression.h"
+#include "profiler.h"
+#include "logger.h"
 
+#include <sys/mman.h>
 
 long int findFileSize(FILE *file){
     fseek(file, 0L, SEEK_END);
@@ -13,7 +18,7 @@ long int findFileSize(FILE *file){
     return filesize;
 }
 
-unsigned char *buildControlPacket(const char *filename, long int filesize, unsigned int *length){
+unsigned char *buildControlPacket(const char *filename, long int filesize, int compressed, int links, unsigned int *length){
     int L1 = 0;
     int L2 = strlen(filename);
     int packetpos = 0;
@@ -25,6 +30,8 @@ unsigned char *buildControlPacket(const char *filename, long int filesize, unsig
     }
 
     *length = 3 + L1 + 2 + L2; // (C, T1,L1, V, T2,L2, V2)
+    if(compressed) *length += 3; // (T3,L3, V3)
+    if(links > 1) *length += 3;  // (T4,L4, V4)
 
     unsigned char *packet = (unsigned char*)malloc(*length);
 
@@ -47,6 +54,18 @@ unsigned char *buildControlPacket(const char *filename, long int filesize, unsig
     for(int j = 0; j < L2; j++){
         packet[packetpos + j] = filename[j];
     }
+    packetpos += L2;
+
+    if(compressed){
+        packet[packetpos++] = 2;
+        packet[packetpos++] = 1;
+        packet[packetpos++] = 1;
+    }
+    if(links > 1){
+        packet[packetpos++] = 3;
+        packet[packetpos++] = 1;
+        packet[packetpos++] = links;
+    }
 
     return packet;
 }
@@ -58,7 +77,9 @@ void buildDataPacket(FILE* file, unsigned char *dataPacket, int dataSize, unsign
     dataPacket[2] = (dataSize >> 8) & 0xFF;
     dataPacket[3] = dataSize & 0xFF;
 
+    PROFILE_START(timer);
     fread(dataPacket + 4, 1, dataSize, file);
+    PROFILE_STOP(ProfileFileIo, timer);
 }
 
 long int extractFileSize(unsigned char* packet){
@@ -75,24 +96,351 @@ long int extractFileSize(unsigned char* packet){
 unsigned char* extractFileName(unsigned char* packet){
     unsigned char numBytes = packet[2]; // file
     unsigned char filenameBytes = packet[3+numBytes+1];
-    unsigned char *filename = (unsigned char*) malloc(filenameBytes);
+    unsigned char *filename = (unsigned char*) malloc(filenameBytes + 1);
     memcpy(filename, packet+3+numBytes+2, filenameBytes);
+    filename[filenameBytes] = '\0';
     return filename;
 }
 
+// Return "1" if the control packet says data packets may be compressed.
+int extractCompression(unsigned char* packet, int size){
+    int i = 1;
+    while(i + 1 < size){
+        if(packet[i] == 2 && packet[i + 1] >= 1 && i + 2 < size) return packet[i + 2];
+        i += 2 + packet[i + 1];
+    }
+    return 0;
+}
+
+// Return the number of bonded lines the control packet announces, "1" if none.
+int extractLinks(unsigned char* packet, int size){
+    int i = 1;
+    while(i + 1 < size){
+        if(packet[i] == 3 && packet[i + 1] >= 1 && i + 2 < size) return packet[i + 2];
+        i += 2 + packet[i + 1];
+    }
+    return 1;
+}
+
 void extractData(unsigned char* packet, unsigned char* buffer, int datasize){
     memcpy(buffer, packet + 4, datasize);
 }
 
+// Reader side of the transmit pipeline: fills free pool buffers with data
+// packets from the file, sized as the link layer last asked for.
+void *fileReaderThread(void *arg){
+    TxPipeline *pipeline = (TxPipeline*) arg;
+    long int bytes = pipeline->filesize;
+    unsigned char identifier = 0;
+
+    while(bytes > 0){
+        pthread_mutex_lock(&pipeline->lock);
+        while(pipeline->count == TX_POOL_SIZE && !pipeline->stop) pthread_cond_wait(&pipeline->notFull, &pipeline->lock);
+        int payload = pipeline->payloadSize;
+        int stop = pipeline->stop;
+        pthread_mutex_unlock(&pipeline->lock);
+        if(stop) break;
+
+        PacketBuffer *slot = &pipeline->pool[pipeline->tail];
+        int dataSize = bytes > (long int) (payload - 4) ? (payload - 4) : bytes;
+        buildDataPacket(pipeline->file, slot->data, dataSize, identifier);
+        slot->size = dataSize + 4;
+        bytes -= dataSize;
+        identifier = (identifier + 1) % 255;
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->tail = (pipeline->tail + 1) % TX_POOL_SIZE;
+        pipeline->count++;
+        pthread_cond_signal(&pipeline->notEmpty);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->done = TRUE;
+    pthread_cond_signal(&pipeline->notEmpty);
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+// Reader side of the transmit pipeline when compressing: each packet holds
+// one block that decompresses on its own, as [4, N, L2, L1, raw size (2 bytes),
+// block]. Blocks are sized from the ratio seen so far to fill the packet.
+// Data that does not shrink goes out as a plain data packet.
+void *compressingReaderThread(void *arg){
+    TxPipeline *pipeline = (TxPipeline*) arg;
+    long int bytes = pipeline->filesize;
+    unsigned char *raw = (unsigned char*) malloc(COMPRESS_MAX_INPUT);
+    int pending = 0;
+    double ratio = 1;
+    unsigned char identifier = 0;
+
+    while(bytes > 0 || pending > 0){
+        pthread_mutex_lock(&pipeline->lock);
+        while(pipeline->count == TX_POOL_SIZE && !pipeline->stop) pthread_cond_wait(&pipeline->notFull, &pipeline->lock);
+        int payload = pipeline->payloadSize;
+        int stop = pipeline->stop;
+        pthread_mutex_unlock(&pipeline->lock);
+        if(stop) break;
+
+        int want = (payload - 6) * ratio;
+        if(want < payload - 4) want = payload - 4;
+        if(want > COMPRESS_MAX_INPUT) want = COMPRESS_MAX_INPUT;
+        if(pending < want && bytes > 0){
+            PROFILE_START(timer);
+            int n = fread(raw + pending, 1, bytes < want - pending ? bytes : want - pending, pipeline->file);
+            PROFILE_STOP(ProfileFileIo, timer);
+            if(n <= 0) break;
+            pending += n;
+            bytes -= n;
+        }
+
+        PacketBuffer *slot = &pipeline->pool[pipeline->tail];
+        int rawSize = pending < want ? pending : want;
+        while(1){
+            PROFILE_START(timer);
+            int size = compressBlock(raw, rawSize, slot->data + 6, payload - 6);
+            PROFILE_STOP(ProfileCompression, timer);
+            if(size >= 0 && size + 2 < rawSize){
+                slot->data[0] = 4;
+                slot->data[1] = identifier;
+                slot->data[2] = ((size + 2) >> 8) & 0xFF;
+                slot->data[3] = (size + 2) & 0xFF;
+                slot->data[4] = (rawSize >> 8) & 0xFF;
+                slot->data[5] = rawSize & 0xFF;
+                slot->size = size + 6;
+                ratio += ((double) rawSize / size - ratio) / 4;
+                break;
+            }
+            if(rawSize <= payload - 4){
+                slot->data[0] = 1;
+                slot->data[1] = identifier;
+                slot->data[2] = (rawSize >> 8) & 0xFF;
+                slot->data[3] = rawSize & 0xFF;
+                memcpy(slot->data + 4, raw, rawSize);
+                slot->size = rawSize + 4;
+                ratio = 1;
+                break;
+            }
+            rawSize /= 2; // did not fit, try with less
+        }
+        memmove(raw, raw + rawSize, pending - rawSize);
+        pending -= rawSize;
+        identifier = (identifier + 1) % 255;
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->tail = (pipeline->tail + 1) % TX_POOL_SIZE;
+        pipeline->count++;
+        pthread_cond_signal(&pipeline->notEmpty);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    free(raw);
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->done = TRUE;
+    pthread_cond_signal(&pipeline->notEmpty);
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+// Sends the whole file as data packets. A reader thread keeps a fixed pool
+// of packet buffers full while this thread drains it into llwrite, so disk
+// reads overlap with the line and memory use does not depend on file size.
+// Return "0" on success or "-1" on error.
+int sendFileData(FILE *file, long int filesize, int compressed, int fd){
+    TxPipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.file = file;
+    pipeline.filesize = filesize;
+    pipeline.payloadSize = lloptimalpayload(fd);
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.notEmpty, NULL);
+    pthread_cond_init(&pipeline.notFull, NULL);
+    for(int i = 0; i < TX_POOL_SIZE; i++){
+        pipeline.pool[i].data = (unsigned char*) malloc(llmaxpayload(fd));
+    }
+
+    pthread_t reader;
+    if(pthread_create(&reader, NULL, compressed ? compressingReaderThread : fileReaderThread, &pipeline) != 0){
+        perror("pthread_create");
+        for(int i = 0; i < TX_POOL_SIZE; i++) free(pipeline.pool[i].data);
+        return -1;
+    }
+
+    int result = 0;
+    while(1){
+        pthread_mutex_lock(&pipeline.lock);
+        while(pipeline.count == 0 && !pipeline.done) pthread_cond_wait(&pipeline.notEmpty, &pipeline.lock);
+        if(pipeline.count == 0){
+            pthread_mutex_unlock(&pipeline.lock);
+            break;
+        }
+        pthread_mutex_unlock(&pipeline.lock);
+
+        PacketBuffer *slot = &pipeline.pool[pipeline.head];
+        if(llwrite(slot->data, slot->size, fd) == -1){
+            // stop the reader, which may be waiting for room, before the pipeline goes away
+            pthread_mutex_lock(&pipeline.lock);
+            pipeline.stop = TRUE;
+            pthread_cond_broadcast(&pipeline.notFull);
+            pthread_mutex_unlock(&pipeline.lock);
+            result = -1;
+            break;
+        }
+        LOG_DEBUG("packet num: %d\n", slot->data[1]);
+
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.head = (pipeline.head + 1) % TX_POOL_SIZE;
+        pipeline.count--;
+        // packet size follows the error rate the link layer measures
+        pipeline.payloadSize = lloptimalpayload(fd);
+        pthread_cond_signal(&pipeline.notFull);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+
+    pthread_join(reader, NULL);
+    for(int i = 0; i < TX_POOL_SIZE; i++) free(pipeline.pool[i].data);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.notEmpty);
+    pthread_cond_destroy(&pipeline.notFull);
+    return result;
+}
+
+// Maps the file for sendFileMapped. Returns NULL if it can not be mapped.
+unsigned char *mapFile(FILE *file, long int filesize){
+    if(filesize <= 0) return NULL;
+    unsigned char *map = (unsigned char*) mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if(map == MAP_FAILED) return NULL;
+    madvise(map, filesize, MADV_SEQUENTIAL);
+    return map;
+}
+
+// Sends the whole file straight from its mapping: llwritev gets the packet
+// header and a slice of the map, so the payload goes from the page cache to
+// the serial port without being copied. The map must outlive llclose; the
+// header is shorter than STUFF_REF_MIN, so it is copied and can stay local.
+// Return "0" on success or "-1" on error.
+int sendFileMapped(const unsigned char *map, long int filesize, int fd){
+    long int offset = 0;
+    unsigned char identifier = 0;
+
+    while(offset < filesize){
+        int payload = lloptimalpayload(fd);
+        int dataSize = filesize - offset > (long int) (payload - 4) ? (payload - 4) : filesize - offset;
+        unsigned char header[4] = {1, identifier, (dataSize >> 8) & 0xFF, dataSize & 0xFF};
+        struct iovec iov[2] = {{header, 4}, {(void*) (map + offset), dataSize}};
+
+        if(llwritev(iov, 2, fd) == -1) return -1;
+        LOG_DEBUG("packet num: %d\n", identifier);
+        offset += dataSize;
+        identifier = (identifier + 1) % 255;
+    }
+    return 0;
+}
+
+// Receives data packets until the end control packet. The output file is
+// preallocated and mapped, and llreadinto destuffs each payload straight to
+// its offset in the file. The mapping has one packet of slack past filesize
+// for the check bytes and the end control packet, trimmed at the end.
+// Compressed packets are read aside and decompressed into the map instead.
+// Return the number of bytes written or "-1" on error.
+long int receiveFileData(const char *filename, long int filesize, int compressed, int fd){
+    int filefd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(filefd < 0){
+        perror("Error opening file");
+        return -1;
+    }
+
+    int packetMax = llmaxpayload(fd);
+    long int mapsize = filesize + packetMax;
+    if(posix_fallocate(filefd, 0, mapsize) != 0 && ftruncate(filefd, mapsize) != 0){
+        perror("Error allocating file");
+        close(filefd);
+        return -1;
+    }
+    unsigned char *map = (unsigned char*) mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, filefd, 0);
+    if(map == MAP_FAILED){
+        perror("mmap");
+        close(filefd);
+        return -1;
+    }
+
+    unsigned char header[4];
+    unsigned char *packet = compressed ? (unsigned char*) malloc(packetMax) : NULL;
+    long int offset = 0;
+    while(1){
+        int packetsize = 0;
+        unsigned char *data = compressed ? packet : map + offset;
+        while(packetsize == 0) packetsize = llreadinto(header, 4, data, packetMax - 4, fd);
+        if(packetsize < 0){
+            LOG_ERROR("Link failed before the end packet\n");
+            offset = -1;
+            break;
+        }
+        if(header[0] == 3) break;
+        if(packetsize < 4) continue;
+
+        int datasize = packetsize - 4;
+        if(header[0] == 4 && datasize > 2){
+            PROFILE_START(timer);
+            datasize = decompressBlock(packet + 2, datasize - 2, map + offset, filesize - offset);
+            PROFILE_STOP(ProfileCompression, timer);
+            if(datasize != ((packet[0] << 8) | packet[1])){
+                LOG_ERROR("Bad compressed packet %d\n", header[1]);
+                offset = -1;
+                break;
+            }
+        }
+        else if(header[0] != 1) continue;
+        else if(compressed){
+            PROFILE_START(timer);
+            memcpy(map + offset, packet, datasize);
+            PROFILE_STOP(ProfileFileIo, timer);
+        }
+        offset += datasize;
+        if(offset > filesize) offset = filesize; // never map past the slack
+    }
+    free(packet);
+
+    munmap(map, mapsize);
+    int result = offset < 0 ? -1 : ftruncate(filefd, offset);
+    close(filefd);
+    return result == 0 ? offset : -1;
+}
+
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
 {
     LinkLayer linklayer;
-    strcpy(linklayer.serialPort, serialPort);
+    char ports[MAX_BOND_LINES][50];
+    int links = splitPortList(serialPort, ports, MAX_BOND_LINES);
+    if(links < 1){
+        fprintf(stderr, "At most %d serial ports of up to 49 characters\n", MAX_BOND_LINES);
+        exit(-1);
+    }
+    strcpy(linklayer.serialPort, transportParse(ports[0], &linklayer.transport));
     linklayer.role = (strcmp(role, "rx") == 0) ? LlRx : LlTx;
     linklayer.baudRate = baudRate;
     linklayer.nRetransmissions = nTries;
     linklayer.timeout = timeout;
+    linklayer.windowSize = WINDOW_SIZE;
+    linklayer.arqMode = ARQ_MODE;
+    linklayer.fcsType = FCS_TYPE;
+    linklayer.maxPayloadSize = MAX_PAYLOAD_SIZE;
+    linklayer.compression = COMPRESSION;
+    linklayer.duplex = DUPLEX;
+    linklayer.fec = FEC;
+    strcpy(linklayer.statisticsFile, STATISTICS_FILE);
+
+    logInit();
+    PROFILE_INIT();
+    if(links > 1){
+        if(bondedApplication(&linklayer, ports, links, filename) < 0){
+            perror("Error in bonded transfer\n");
+            exit(-1);
+        }
+        PROFILE_REPORT();
+        return;
+    }
 
     int fd = llopen(linklayer);
     if(fd < 0){
@@ -100,7 +448,7 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         exit(-1);
     }
     else{
-        printf("Connection between Tx and Rx succed\n");
+        LOG_INFO("Connection between Tx and Rx succed\n");
     }
 
     switch (linklayer.role){
@@ -114,38 +462,26 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
             }
             
             long int filesize = findFileSize(file);
+            int compressed = llcompression(fd);
             unsigned int cplength;
-            printf("Filesize: %ld\n", filesize);
-            unsigned char* controlPacket = buildControlPacket(filename, filesize, &cplength);
-            printf("Control Packet Length: %u\n", cplength);
+            LOG_INFO("Filesize: %ld\n", filesize);
+            unsigned char* controlPacket = buildControlPacket(filename, filesize, compressed, 1, &cplength);
+            LOG_DEBUG("Control Packet Length: %u\n", cplength);
 
             if(llwrite(controlPacket, cplength, fd) == -1){
                 perror("Error while writing start control packet\n");
                 exit(-1);
             }
             else{
-                printf("Sucess while writing start control packet\n");
+                LOG_INFO("Sucess while writing start control packet\n");
             }
 
-            long int bytes = filesize;
-            unsigned char identifier = 0;
-
-            while(bytes > 0){
-                printf("Value of bytes: %ld\n", bytes);
-                int dataSize = bytes > (long int) (MAX_PAYLOAD_SIZE - 4) ? (MAX_PAYLOAD_SIZE - 4) : bytes;
-                int dataPacketSize = dataSize + 4;
-                unsigned char* dataPacket = (unsigned char*) malloc(dataPacketSize);
-                buildDataPacket(file, dataPacket, dataSize, identifier);
-
-                if(llwrite(dataPacket, dataPacketSize, fd) == -1){
-                    perror("Error while writing data packet\n");
-                    exit(-1);
-                }
-                else{
-                    printf("packet num: %d\n", identifier);
-                }
-                bytes -= dataSize;
-                identifier = (identifier + 1) % 255;
+            // compressed packets are built by the reader thread, not sent from the map
+            unsigned char *map = ZERO_COPY_TX && !compressed ? mapFile(file, filesize) : NULL;
+            int sent = map != NULL ? sendFileMapped(map, filesize, fd) : sendFileData(file, filesize, compressed, fd);
+            if(sent == -1){
+                perror("Error while writing data packet\n");
+                exit(-1);
             }
 
             controlPacket[0] = 3;
@@ -154,41 +490,34 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
                 exit(-1);
             }
             else{
-                printf("Sucess while writing end control packet\n");
+                LOG_INFO("Sucess while writing end control packet\n");
             }
-            llclose(fd, linklayer);
+            llclose(fd, linklayer, SHOW_STATISTICS);
+            if(map != NULL) munmap(map, filesize);
+            PROFILE_REPORT();
             break;
         }
 
         case LlRx:{
-            unsigned char *packet = (unsigned char*) malloc(MAX_PAYLOAD_SIZE);
+            unsigned char *packet = (unsigned char*) malloc(llmaxpayload(fd));
             int packetsize = 0;
-            while(1){
-                packetsize = llread(packet, fd);
-                if(packetsize > 0)  break;
+            while(packetsize == 0) packetsize = llread(packet, fd);
+            if(packetsize < 0){
+                LOG_ERROR("Link failed before the start packet\n");
+                exit(-1);
             }
             // read control packet and now need to extract filename aswell as filesize
             long int rxFileSize = extractFileSize(packet);
             unsigned char* rxFileName = extractFileName(packet);
+            int rxCompressed = extractCompression(packet, packetsize);
 
-            FILE* rxFile = fopen((char *) rxFileName, "wb+"); // update rxFileName to filename if testing in the same computer with many terminals.
-
-            while(1){
-                while(1){
-                    packetsize = llread(packet, fd);
-                    if(packetsize > 0) break;
-                }
-                if(packet[0] == 3) break;
-                else if(packet[0] != 3){
-                    unsigned char *buffer = (unsigned char*)malloc(packetsize);
-                    extractData(packet, buffer, packetsize - 4);
-                    fwrite(buffer, 1, packetsize -4, rxFile);
-                    free(buffer);
-                }
-                else continue;
+            if(receiveFileData((char *) rxFileName, rxFileSize, rxCompressed, fd) == -1){ // update rxFileName to filename if testing in the same computer with many terminals.
+                perror("Error while receiving data packets\n");
+                exit(-1);
             }
-            fclose(rxFile);
-            llclose(fd, linklayer);
+            llclose(fd, linklayer, SHOW_STATISTICS);
+            PROFILE_REPORT();
+            break;
         }
         default:
             exit(-1);
@@ -0,0 +1,313 @@
+// Link bonding implementation
+
+#include "bonding.h"
+#include "application_layer.h"
+#include "logger.h"
+#include "profiler.h"
+
+#include <sys/mman.h>
+
+int splitPortList(const char *list, char ports[][50], int maxPorts){
+    int count = 0;
+    const char *start = list;
+
+    while(1){
+        const char *end = strchr(start, ',');
+        int length = end != NULL ? end - start : (int) strlen(start);
+        if(count == maxPorts || length >= 50) return -1;
+        memcpy(ports[count], start, length);
+        ports[count][length] = '\0';
+        count++;
+        if(end == NULL) break;
+        start = end + 1;
+    }
+    return count;
+}
+
+void *bondOpenThread(void *arg){
+    BondLine *line = (BondLine*) arg;
+    line->fd = llopen(line->params);
+    return NULL;
+}
+
+int openBondedLines(BondLine *lines, int count){
+    pthread_t threads[MAX_BOND_LINES];
+    for(int i = 0; i < count; i++){
+        if(pthread_create(&threads[i], NULL, bondOpenThread, &lines[i]) != 0){
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    int result = 0;
+    for(int i = 0; i < count; i++){
+        pthread_join(threads[i], NULL);
+        if(lines[i].fd < 0){
+            LOG_ERROR("Line %s failed to open\n", lines[i].params.serialPort);
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// Return "0" if every open line closed cleanly.
+int closeBondedLines(BondLine *lines, int count, int showStatistics){
+    int result = 0;
+    for(int i = 0; i < count; i++){
+        if(lines[i].fd >= 0 && llclose(lines[i].fd, lines[i].params, showStatistics) < 0) result = -1;
+    }
+    return result;
+}
+
+// Sender of one line: takes slices of the file sized for this line until
+// none are left or another line failed, then ends its side of the transfer.
+void *bondSenderThread(void *arg){
+    BondLine *line = (BondLine*) arg;
+    BondStripe *stripe = line->stripe;
+    unsigned char *packet = (unsigned char*) malloc(llmaxpayload(line->fd));
+    unsigned char identifier = 0;
+
+    while(1){
+        int payload = lloptimalpayload(line->fd);
+        pthread_mutex_lock(&stripe->lock);
+        long int offset = stripe->offset;
+        int dataSize = stripe->filesize - offset > (long int) (payload - BOND_HEADER_SIZE) ? (payload - BOND_HEADER_SIZE) : stripe->filesize - offset;
+        if(stripe->failed) dataSize = 0;
+        stripe->offset += dataSize;
+        pthread_mutex_unlock(&stripe->lock);
+        if(dataSize <= 0) break;
+
+        unsigned char header[BOND_HEADER_SIZE] = {BOND_DATA_PACKET, identifier, (dataSize >> 8) & 0xFF, dataSize & 0xFF,
+                                                  (offset >> 24) & 0xFF, (offset >> 16) & 0xFF, (offset >> 8) & 0xFF, offset & 0xFF};
+        int written;
+        if(stripe->map != NULL){
+            // the header is shorter than STUFF_REF_MIN, so llwritev copies it
+            struct iovec iov[2] = {{header, BOND_HEADER_SIZE}, {stripe->map + offset, dataSize}};
+            written = llwritev(iov, 2, line->fd);
+        }
+        else{
+            memcpy(packet, header, BOND_HEADER_SIZE);
+            PROFILE_START(timer);
+            int n = pread(fileno(stripe->file), packet + BOND_HEADER_SIZE, dataSize, offset);
+            PROFILE_STOP(ProfileFileIo, timer);
+            written = n == dataSize ? llwrite(packet, BOND_HEADER_SIZE + dataSize, line->fd) : -1;
+        }
+        if(written == -1){
+            // the slice is lost with the line, so the transfer cannot complete
+            LOG_ERROR("%s failed at offset %ld\n", line->params.serialPort, offset);
+            pthread_mutex_lock(&stripe->lock);
+            stripe->failed = TRUE;
+            pthread_mutex_unlock(&stripe->lock);
+            line->result = -1;
+            break;
+        }
+        LOG_DEBUG("%s: packet %d, offset %ld\n", line->params.serialPort, identifier, offset);
+        line->bytes += dataSize;
+        identifier = (identifier + 1) % 255;
+    }
+
+    if(line->result == 0 && llwrite(stripe->endPacket, stripe->endLength, line->fd) == -1) line->result = -1;
+    free(packet);
+    return NULL;
+}
+
+int sendFileBonded(BondLine *lines, int count, BondStripe *stripe){
+    pthread_t threads[MAX_BOND_LINES];
+    int started = 0;
+    for(; started < count; started++){
+        lines[started].stripe = stripe;
+        lines[started].bytes = 0;
+        lines[started].result = 0;
+        if(pthread_create(&threads[started], NULL, bondSenderThread, &lines[started]) != 0){
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    int result = started == count ? 0 : -1;
+    for(int i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+        if(lines[i].result < 0) result = -1;
+        LOG_INFO("%s carried %ld bytes (%.1f%%)\n", lines[i].params.serialPort, lines[i].bytes,
+                 stripe->filesize > 0 ? 100.0 * lines[i].bytes / stripe->filesize : 0);
+    }
+    return result;
+}
+
+// Receiver of one line: puts every bonded data packet at its offset until
+// the end control packet arrives on this line or the line fails.
+void *bondReceiverThread(void *arg){
+    BondLine *line = (BondLine*) arg;
+    BondStripe *stripe = line->stripe;
+    unsigned char *packet = (unsigned char*) malloc(llmaxpayload(line->fd));
+
+    while(1){
+        int packetsize = llread(packet, line->fd);
+        if(packetsize < 0){
+            LOG_ERROR("%s failed before the end packet\n", line->params.serialPort);
+            line->result = -1;
+            break;
+        }
+        if(packetsize == 0) continue;
+        if(packet[0] == 3) break;
+        if(packet[0] != BOND_DATA_PACKET || packetsize < BOND_HEADER_SIZE) continue;
+
+        int dataSize = packetsize - BOND_HEADER_SIZE;
+        long int offset = (long int) packet[4] << 24 | packet[5] << 16 | packet[6] << 8 | packet[7];
+        if(dataSize != (packet[2] << 8 | packet[3]) || offset + dataSize > stripe->filesize){
+            LOG_ERROR("%s: bad packet %d\n", line->params.serialPort, packet[1]);
+            line->result = -1;
+            continue;
+        }
+        PROFILE_START(timer);
+        memcpy(stripe->map + offset, packet + BOND_HEADER_SIZE, dataSize);
+        PROFILE_STOP(ProfileFileIo, timer);
+        line->bytes += dataSize;
+    }
+    free(packet);
+    return NULL;
+}
+
+long int receiveFileBonded(BondLine *lines, int count, const char *filename, long int filesize){
+    int filefd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(filefd < 0){
+        perror("Error opening file");
+        return -1;
+    }
+    if(filesize > 0 && posix_fallocate(filefd, 0, filesize) != 0 && ftruncate(filefd, filesize) != 0){
+        perror("Error allocating file");
+        close(filefd);
+        return -1;
+    }
+
+    BondStripe stripe;
+    memset(&stripe, 0, sizeof(stripe));
+    stripe.filesize = filesize;
+    if(filesize > 0){
+        stripe.map = (unsigned char*) mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, filefd, 0);
+        if(stripe.map == MAP_FAILED){
+            perror("mmap");
+            close(filefd);
+            return -1;
+        }
+    }
+
+    pthread_t threads[MAX_BOND_LINES];
+    int started = 0;
+    for(; started < count; started++){
+        lines[started].stripe = &stripe;
+        lines[started].bytes = 0;
+        lines[started].result = 0;
+        if(pthread_create(&threads[started], NULL, bondReceiverThread, &lines[started]) != 0){
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    // no packet is sent twice, so the bytes add up to the file once all arrived
+    long int received = started == count ? 0 : -1;
+    for(int i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+        if(lines[i].result < 0) received = -1;
+        if(received >= 0) received += lines[i].bytes;
+        LOG_INFO("%s carried %ld bytes\n", lines[i].params.serialPort, lines[i].bytes);
+    }
+    if(received != filesize){
+        LOG_ERROR("Received %ld of %ld bytes\n", received, filesize);
+        received = -1;
+    }
+
+    if(stripe.map != NULL) munmap(stripe.map, filesize);
+    close(filefd);
+    return received;
+}
+
+int bondedApplication(const LinkLayer *params, char ports[][50], int count, const char *filename){
+    BondLine lines[MAX_BOND_LINES];
+    memset(lines, 0, sizeof(lines));
+    for(int i = 0; i < count; i++){
+        lines[i].params = *params;
+        strcpy(lines[i].params.serialPort, transportParse(ports[i], &lines[i].params.transport));
+        lines[i].fd = -1;
+    }
+
+    int result = openBondedLines(lines, count);
+    if(result < 0){
+        closeBondedLines(lines, count, FALSE);
+        return -1;
+    }
+    LOG_INFO("Bonded %d lines\n", count);
+
+    if(params->role == LlTx){
+        FILE *file = fopen(filename, "rb");
+        if(file == NULL){
+            // the receiver waits for a start packet, not DISC, so the lines are left to hang up
+            perror("Error opening file");
+            return -1;
+        }
+
+        BondStripe stripe;
+        memset(&stripe, 0, sizeof(stripe));
+        stripe.file = file;
+        stripe.filesize = findFileSize(file);
+        // the offset in a bonded data packet has 4 bytes
+        if(stripe.filesize > 0xFFFFFFFFL){
+            LOG_ERROR("Bonded transfers are limited to 4 GiB\n");
+            fclose(file);
+            return -1;
+        }
+        stripe.map = mapFile(file, stripe.filesize);
+        pthread_mutex_init(&stripe.lock, NULL);
+
+        // the start packet tells the receiver how many lines to expect
+        unsigned int cplength;
+        unsigned char *controlPacket = buildControlPacket(filename, stripe.filesize, FALSE, count, &cplength);
+        if(llwrite(controlPacket, cplength, lines[0].fd) == -1){
+            LOG_ERROR("Error while writing start control packet\n");
+            if(stripe.map != NULL) munmap(stripe.map, stripe.filesize);
+            fclose(file);
+            free(controlPacket);
+            return -1;
+        }
+
+        // every line ends with its own end control packet
+        unsigned char *endPacket = (unsigned char*) malloc(cplength);
+        memcpy(endPacket, controlPacket, cplength);
+        endPacket[0] = 3;
+        stripe.endPacket = endPacket;
+        stripe.endLength = cplength;
+        result = sendFileBonded(lines, count, &stripe);
+
+        if(closeBondedLines(lines, count, SHOW_STATISTICS) < 0) result = -1;
+        if(stripe.map != NULL) munmap(stripe.map, stripe.filesize);
+        fclose(file);
+        free(controlPacket);
+        free(endPacket);
+        return result;
+    }
+
+    unsigned char *packet = (unsigned char*) malloc(llmaxpayload(lines[0].fd));
+    int packetsize = 0;
+    while(packetsize == 0) packetsize = llread(packet, lines[0].fd);
+    if(packetsize < 0){
+        LOG_ERROR("%s failed before the start packet\n", lines[0].params.serialPort);
+        closeBondedLines(lines, count, FALSE);
+        free(packet);
+        return -1;
+    }
+
+    long int rxFileSize = extractFileSize(packet);
+    unsigned char *rxFileName = extractFileName(packet);
+    int rxLinks = extractLinks(packet, packetsize);
+    if(packet[0] != 2 || rxLinks != count){
+        // the other lines would never end, so they are not closed
+        LOG_ERROR("Transmitter bonds %d lines, this end %d\n", rxLinks, count);
+        return -1;
+    }
+    if(receiveFileBonded(lines, count, (char *) rxFileName, rxFileSize) < 0) result = -1;
+
+    closeBondedLines(lines, count, SHOW_STATISTICS);
+    free(rxFileName);
+    free(packet);
+    return result;
+}
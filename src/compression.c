@@ -0,0 +1,136 @@
+// Data packet compression implementation
+// Greedy LZ77 with a single hash probe, like LZ4: every sequence is a token
+// (literal length << 4 | match length - 4), extra length bytes, the literals,
+// a 2-byte little endian offset and extra match length bytes. The block ends
+// with literals only.
+
+#include "compression.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5 // a block always ends with this many literals
+#define MATCH_LIMIT 12  // no match starts this close to the end
+
+uint32_t read32(const unsigned char *p){
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+int hash32(uint32_t value){
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+int writeLength(unsigned char *out, int op, int length){
+    while(length >= 255){
+        out[op++] = 255;
+        length -= 255;
+    }
+    out[op++] = length;
+    return op;
+}
+
+// Appends one sequence at op; matchLength "0" writes the final literals.
+// Returns the new op, or "-1" if it does not fit.
+int writeSequence(unsigned char *out, int op, int capacity, const unsigned char *literals,
+                  int literalLength, int offset, int matchLength){
+    if(op + 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1 > capacity) return -1;
+
+    int token = op++;
+    out[token] = (literalLength < 15 ? literalLength : 15) << 4;
+    if(literalLength >= 15) op = writeLength(out, op, literalLength - 15);
+    memcpy(out + op, literals, literalLength);
+    op += literalLength;
+    if(matchLength == 0) return op;
+
+    out[op++] = offset & 0xFF;
+    out[op++] = offset >> 8;
+    matchLength -= MIN_MATCH;
+    out[token] |= matchLength < 15 ? matchLength : 15;
+    if(matchLength >= 15) op = writeLength(out, op, matchLength - 15);
+    return op;
+}
+
+int compressBlock(const unsigned char *in, int size, unsigned char *out, int capacity){
+    int table[1 << HASH_BITS];
+    int anchor = 0;
+    int ip = 0;
+    int op = 0;
+
+    memset(table, 0, sizeof(table));
+    while(ip < size - MATCH_LIMIT){
+        uint32_t sequence = read32(in + ip);
+        int h = hash32(sequence);
+        int ref = table[h];
+        table[h] = ip;
+        if(ref >= ip || ip - ref > MAX_OFFSET || read32(in + ref) != sequence){
+            ip += 1 + ((ip - anchor) >> 6); // skip faster through data that does not compress
+            continue;
+        }
+
+        while(ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]){
+            ip--;
+            ref--;
+        }
+        int length = MIN_MATCH;
+        while(ip + length < size - LAST_LITERALS && in[ip + length] == in[ref + length]) length++;
+
+        op = writeSequence(out, op, capacity, in + anchor, ip - anchor, ip - ref, length);
+        if(op < 0) return -1;
+        ip += length;
+        anchor = ip;
+        if(ip - 2 < size - MATCH_LIMIT) table[hash32(read32(in + ip - 2))] = ip - 2;
+    }
+    return writeSequence(out, op, capacity, in + anchor, size - anchor, 0, 0);
+}
+
+int decompressBlock(const unsigned char *in, int size, unsigned char *out, int capacity){
+    int ip = 0;
+    int op = 0;
+
+    while(ip < size){
+        int token = in[ip++];
+
+        int literalLength = token >> 4;
+        if(literalLength == 15){
+            unsigned char byte;
+            do{
+                if(ip >= size) return -1;
+                byte = in[ip++];
+                literalLength += byte;
+            } while(byte == 255);
+        }
+        if(literalLength > size - ip || literalLength > capacity - op) return -1;
+        memcpy(out + op, in + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+        if(ip == size) break;
+
+        if(ip + 2 > size) return -1;
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op) return -1;
+
+        int matchLength = token & 15;
+        if(matchLength == 15){
+            unsigned char byte;
+            do{
+                if(ip >= size) return -1;
+                byte = in[ip++];
+                matchLength += byte;
+            } while(byte == 255);
+        }
+        matchLength += MIN_MATCH;
+        if(matchLength > capacity - op) return -1;
+
+        // the match may overlap the bytes it produces
+        if(offset >= matchLength) memcpy(out + op, out + op - offset, matchLength);
+        else for(int i = 0; i < matchLength; i++) out[op + i] = out[op + i - offset];
+        op += matchLength;
+    }
+    return op;
+}
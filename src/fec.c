@@ -0,0 +1,176 @@
+// Forward error correction implementation
+// Systematic Reed-Solomon with field polynomial x^8 + x^4 + x^3 + x^2 + 1 and
+// generator roots alpha^0 .. alpha^(FEC_PARITY_SIZE - 1). Each block is
+// encoded by an LFSR; a block whose syndromes are not all zero is decoded with
+// Berlekamp-Massey, a Chien search and Forney's formula.
+
+#include "fec.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define GF_POLY 0x11D
+
+unsigned char gfExp[512];
+unsigned char gfLog[256];
+
+// Generator coefficients times every feedback byte, so one encoding step is a lookup and XORs
+unsigned char fecGenTable[256][FEC_PARITY_SIZE];
+pthread_once_t fecTablesOnce = PTHREAD_ONCE_INIT;
+
+unsigned char gfMul(unsigned char a, unsigned char b){
+    if(a == 0 || b == 0) return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+unsigned char gfDiv(unsigned char a, unsigned char b){
+    if(a == 0) return 0;
+    return gfExp[gfLog[a] + 255 - gfLog[b]];
+}
+
+void buildFecTables(void){
+    int x = 1;
+    for(int i = 0; i < 255; i++){
+        gfExp[i] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if(x & 0x100) x ^= GF_POLY;
+    }
+    for(int i = 255; i < 512; i++) gfExp[i] = gfExp[i - 255];
+
+    // g(x) = (x + alpha^0) ... (x + alpha^(FEC_PARITY_SIZE - 1)), highest degree first
+    unsigned char gen[FEC_PARITY_SIZE + 1] = {1};
+    for(int i = 0; i < FEC_PARITY_SIZE; i++){
+        for(int j = i + 1; j > 0; j--) gen[j] ^= gfMul(gen[j - 1], gfExp[i]);
+    }
+    for(int feedback = 0; feedback < 256; feedback++){
+        for(int i = 0; i < FEC_PARITY_SIZE; i++) fecGenTable[feedback][i] = gfMul(feedback, gen[i + 1]);
+    }
+}
+
+void fecTablesInit(void){
+    pthread_once(&fecTablesOnce, buildFecTables);
+}
+
+int fecParitySize(int size){
+    return (size + FEC_BLOCK_DATA - 1) / FEC_BLOCK_DATA * FEC_PARITY_SIZE;
+}
+
+int fecDataSize(int frameSize){
+    int blocks = (frameSize + 254) / 255;
+    int size = frameSize - blocks * FEC_PARITY_SIZE;
+    if(size <= 0 || fecParitySize(size) != blocks * FEC_PARITY_SIZE) return -1;
+    return size;
+}
+
+void fecEncoderInit(FecEncoder *encoder, int size, unsigned char *parity){
+    encoder->parity = parity;
+    encoder->blocks = (size + FEC_BLOCK_DATA - 1) / FEC_BLOCK_DATA;
+    encoder->position = 0;
+    memset(parity, 0, fecParitySize(size));
+}
+
+void fecEncode(FecEncoder *encoder, const unsigned char *buf, int size){
+    for(int i = 0; i < size; i++){
+        unsigned char *reg = encoder->parity + (encoder->position++ % encoder->blocks) * FEC_PARITY_SIZE;
+        const unsigned char *row = fecGenTable[buf[i] ^ reg[0]];
+        for(int j = 0; j < FEC_PARITY_SIZE - 1; j++) reg[j] = reg[j + 1] ^ row[j];
+        reg[FEC_PARITY_SIZE - 1] = row[FEC_PARITY_SIZE - 1];
+    }
+}
+
+// Value of poly, lowest degree first, at x.
+unsigned char gfEval(const unsigned char *poly, int degree, unsigned char x){
+    unsigned char value = 0;
+    for(int i = degree; i >= 0; i--) value = gfMul(value, x) ^ poly[i];
+    return value;
+}
+
+// Repairs one codeword of n bytes, its parity in the last FEC_PARITY_SIZE.
+// Returns the number of bytes corrected, or "-1".
+int decodeBlock(unsigned char *code, int n){
+    unsigned char syndromes[FEC_PARITY_SIZE];
+    int clean = 1;
+    for(int i = 0; i < FEC_PARITY_SIZE; i++){
+        unsigned char syndrome = 0;
+        for(int k = 0; k < n; k++) syndrome = gfMul(syndrome, gfExp[i]) ^ code[k];
+        syndromes[i] = syndrome;
+        if(syndrome != 0) clean = 0;
+    }
+    if(clean) return 0;
+
+    // Berlekamp-Massey: error locator, lowest degree first
+    unsigned char locator[FEC_PARITY_SIZE + 1] = {1};
+    unsigned char previous[FEC_PARITY_SIZE + 1] = {1};
+    unsigned char saved[FEC_PARITY_SIZE + 1];
+    unsigned char previousDiscrepancy = 1;
+    int errors = 0, shift = 1;
+    for(int i = 0; i < FEC_PARITY_SIZE; i++){
+        unsigned char discrepancy = syndromes[i];
+        for(int j = 1; j <= errors; j++) discrepancy ^= gfMul(locator[j], syndromes[i - j]);
+        if(discrepancy == 0){
+            shift++;
+            continue;
+        }
+
+        unsigned char scale = gfDiv(discrepancy, previousDiscrepancy);
+        memcpy(saved, locator, sizeof(saved));
+        for(int j = shift; j <= FEC_PARITY_SIZE; j++) locator[j] ^= gfMul(scale, previous[j - shift]);
+        if(2 * errors <= i){
+            errors = i + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            previousDiscrepancy = discrepancy;
+            shift = 1;
+        }
+        else shift++;
+    }
+    if(errors > FEC_PARITY_SIZE / 2) return -1;
+
+    // error evaluator: syndromes times locator, mod x^FEC_PARITY_SIZE
+    unsigned char evaluator[FEC_PARITY_SIZE] = {0};
+    for(int i = 0; i < FEC_PARITY_SIZE; i++){
+        for(int j = 0; j <= i && j <= errors; j++) evaluator[i] ^= gfMul(locator[j], syndromes[i - j]);
+    }
+    // formal derivative: the odd terms, one degree down
+    unsigned char derivative[FEC_PARITY_SIZE + 1] = {0};
+    for(int j = 1; j <= errors; j += 2) derivative[j - 1] = locator[j];
+
+    // the byte k positions from the end is wrong if the locator has a root at alpha^-k
+    int positions[FEC_PARITY_SIZE / 2];
+    unsigned char values[FEC_PARITY_SIZE / 2];
+    int found = 0;
+    for(int k = 0; k < n; k++){
+        unsigned char inverse = gfExp[(255 - k) % 255];
+        if(gfEval(locator, errors, inverse) != 0) continue;
+        unsigned char denominator = gfEval(derivative, errors, inverse);
+        if(denominator == 0 || found == errors) return -1;
+        positions[found] = n - 1 - k;
+        values[found] = gfMul(gfExp[k], gfDiv(gfEval(evaluator, FEC_PARITY_SIZE - 1, inverse), denominator));
+        found++;
+    }
+    if(found != errors) return -1;
+
+    for(int i = 0; i < found; i++) code[positions[i]] ^= values[i];
+    return found;
+}
+
+int fecDecode(unsigned char *data, int size, const unsigned char *parity){
+    int blocks = (size + FEC_BLOCK_DATA - 1) / FEC_BLOCK_DATA;
+    int corrected = 0;
+
+    for(int block = 0; block < blocks; block++){
+        unsigned char code[255];
+        int n = 0;
+        for(int i = block; i < size; i += blocks) code[n++] = data[i];
+        memcpy(code + n, parity + block * FEC_PARITY_SIZE, FEC_PARITY_SIZE);
+
+        int fixed = decodeBlock(code, n + FEC_PARITY_SIZE);
+        if(fixed < 0) return -1;
+        if(fixed == 0) continue;
+
+        n = 0;
+        for(int i = block; i < size; i += blocks) data[i] = code[n++];
+        corrected += fixed;
+    }
+    return corrected;
+}
@@ -1,227 +1,1037 @@
 // Link layer protocol implementation
 
-#include "link_layer.h"
+#include "link_layer_internal.h"
 #include "macros.h"
+#include "fec.h"
+#include "profiler.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/timerfd.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
-volatile int alarmEnabled = FALSE;
-int alarmCount = 0;
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // writev limit on Linux
+#endif
 
-unsigned int tramaCtx = 0;
-unsigned int tramaCrx = 1;
-int nRetransmissions = 0;
-int timeout = 0;
+// State of one connection, behind the descriptor llopen returns
+struct LinkConnection
+{
+    pthread_mutex_t lock;    // held by every ll* call on the connection
+    pthread_cond_t progress; // full duplex: broadcast by pumpLine after each frame
+    atomic_int open;         // set by llopen once it takes the slot, cleared by llclose
 
-int serialPortConnection(LinkLayer connectionParameters)
-{   
-    const char *serialPortName = connectionParameters.serialPort;
-    // Open serial port device for reading and writing and not as controlling tty
-    // because we don't want to get killed if linenoise sends CTRL-C.
-    int fd = open(serialPortName, O_RDWR | O_NOCTTY);
-    if (fd < 0)
-    {
-        perror(serialPortName);
-        exit(-1);
-    }
+    // Retransmission timer, watched by poll() next to the serial port
+    int timerFd;
+    int timerExpired;
+    int timerCount;
 
-    struct termios oldtio;
-    struct termios newtio;
+    unsigned int tramaCtx;  // next N(s) to send
+    unsigned int tramaBase; // oldest unacknowledged N(s)
+    unsigned int tramaCrx;  // next N(s) expected by the receiver
+    int nRetransmissions;
+    int nRetransmissions_left;
+    int timeout; // ms
 
-    // Save current port settings
-    if (tcgetattr(fd, &oldtio) == -1)
-    {
-        perror("tcgetattr");
-        exit(-1);
-    }
+    // Line rate (bit/s) and when the last byte written leaves the port (ms).
+    // Timers and RTT samples start from there, not from the write() call.
+    int lineBaudRate;
+    long long lineFreeAt;
+
+    // Retransmission timeout estimated from the measured round trip (ms)
+    double rttSmoothed;
+    double rttVariance;
+    int rttSamples;
+    int rto;
+    int minRto;
+    int windowSize;
+    ArqMode arqMode;
+    FcsType fcsType;
+    int maxPayload;
+    int compression;
+    int duplex;
+    int fec;
+    int rejSent;
+
+    // Frames kept for retransmission, indexed by N(s), as writev lists.
+    // Each slot can hold the largest stuffed frame, allocated once at llopen.
+    GatherFrame windowFrames[SEQ_MODULO];
+    int windowFrameSizes[SEQ_MODULO];
+
+    // FEC: payload of each frame in the window, to rebuild it with parity
+    unsigned char *windowPayloads[SEQ_MODULO];
+    int windowPayloadSizes[SEQ_MODULO];
+
+    // Selective Repeat: per-frame retransmission deadline and retries left
+    long long frameDeadlines[SEQ_MODULO];
+    int frameRetries[SEQ_MODULO];
+
+    // Frame error rate and mean frame length on the line, exponentially averaged
+    double ferEstimate;
+    double ferFrameBytes;
+
+    // When each frame was last sent and whether it had to be resent (Karn's rule)
+    long long frameSentAt[SEQ_MODULO];
+    int frameRetransmitted[SEQ_MODULO];
+
+    // Selective Repeat: reorder buffer, indexed by N(s).
+    // In full duplex every frame received waits here until llread takes it.
+    unsigned char *rxFrames[SEQ_MODULO];
+    int rxFrameSizes[SEQ_MODULO];
+    int rxFrameBuffered[SEQ_MODULO];
+    int srejSent[SEQ_MODULO];
+    unsigned int tramaDeliver; // next buffered N(s) to hand to the application
+
+    // Receive buffer, filled with one read() and drained byte by byte by the parsers
+    unsigned char rxBuffer[RX_BUFFER_SIZE];
+    int rxBufferStart;
+    int rxBufferEnd;
 
-    // Clear struct for new port settings
-    memset(&newtio, 0, sizeof(newtio));
+    LinkStatistics statistics;
+    long long openedAt;
 
-    newtio.c_cflag = connectionParameters.baudRate | CS8 | CLOCAL | CREAD;
-    newtio.c_iflag = IGNPAR;
-    newtio.c_oflag = 0;
+    // Byte pipe under the protocol, opened by llopen, and whether it hung up
+    Transport transport;
+    int lineDown;
 
-    // Set input mode (non-canonical, no echo,...)
-    newtio.c_lflag = 0;
-    newtio.c_cc[VTIME] = 0; // Inter-character timer unused
-    newtio.c_cc[VMIN] = 0;  // Blocking read until 5 chars received
+    // RR/REJ parser state, kept across calls so answers can be polled.
+    // In full duplex the same parser takes I-frames too.
+    llMachineState answerState;
+    unsigned char answerControl;
 
-    // VTIME e VMIN should be changed in order to protect with a
-    // timeout the reception of the following character(s)
+    // Full duplex: I-frame being read by pumpLine, and whether a thread is
+    // in there. Frames whose slot in rxFrames is still taken go to rxScratch,
+    // only to check them for their N(r).
+    int pumping;
+    DestuffState frameDestuff;
+    uint32_t frameFcs;
+    unsigned char *rxScratch;
 
-    // Now clean the line and activate the settings for the port
-    // tcflush() discards data written to the object referred to
-    // by fd but not transmitted, or data received but not read,
-    // depending on the value of queue_selector:
-    //   TCIFLUSH - flushes data received but not read.
-    tcflush(fd, TCIOFLUSH);
+    // Full duplex: frames received in sequence that no I-frame has acknowledged yet
+    int ackPending;
+    long long ackDeadline;
 
-    // Set new port settings
-    if (tcsetattr(fd, TCSANOW, &newtio) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
+    // FEC: frames left to send with parity, the parity of the frame being
+    // built, and the buffer a received frame with parity is destuffed into
+    // whole, as it is only repaired once it is complete
+    int fecFramesLeft;
+    unsigned char *fecParity;
+    unsigned char *fecFrame;
+    int rxCapacity; // bytes rxFrames, rxScratch and fecFrame hold
+};
+
+// Connections by descriptor. A closed one stays here, so its statistics can
+// still be read, until llopen reuses the slot.
+LinkConnection *connections[MAX_CONNECTIONS];
+pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Opens the transport chosen in connectionParameters.
+// Return "0" on success or "-1" on error.
+int serialPortConnection(LinkConnection *conn, LinkLayer connectionParameters){
+    if(transportOpen(&conn->transport, connectionParameters.transport, connectionParameters.serialPort,
+                     connectionParameters.baudRate) < 0){
+        return -1;
     }
+    LOG_INFO("New termios structure set\n");
+    return 0;
+}
 
-    printf("New termios structure set\n");
+long long currentTimeMs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-    return fd;
+// Accounts for size bytes just written at 10 bits per byte.
+// Returns when the last of them will have left the port.
+long long lineQueue(LinkConnection *conn, int size){
+    long long now = currentTimeMs();
+    if(conn->lineFreeAt < now) conn->lineFreeAt = now;
+    if(conn->lineBaudRate > 0) conn->lineFreeAt += (size * 10000LL + conn->lineBaudRate - 1) / conn->lineBaudRate;
+    return conn->lineFreeAt;
 }
 
-void alarmHandler(int signal)
-{
-    alarmEnabled = FALSE; 
-    alarmCount++;
+// Arms the retransmission timer to fire at deadlineMs (CLOCK_MONOTONIC);
+// "0" disarms it.
+void setTimer(LinkConnection *conn, long long deadlineMs){
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadlineMs / 1000;
+    spec.it_value.tv_nsec = (deadlineMs % 1000) * 1000000;
 
-    printf("Alarm #%d\n", alarmCount);
+    conn->timerExpired = FALSE;
+    timerfd_settime(conn->timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
 }
  
-int sendFrame(int fd, unsigned char adress, unsigned char control){
+// Jacobson/Karels: smoothed RTT and mean deviation, RTO = SRTT + 4 * RTTVAR.
+void updateRto(LinkConnection *conn, long long sampleMs){
+    double sample = sampleMs > 0 ? sampleMs : 0;
+    if(conn->rttSamples == 0){
+        conn->rttSmoothed = sample;
+        conn->rttVariance = sample / 2;
+    }
+    else{
+        double error = sample - conn->rttSmoothed;
+        conn->rttVariance += ((error < 0 ? -error : error) - conn->rttVariance) / 4;
+        conn->rttSmoothed += error / 8;
+    }
+    conn->rttSamples++;
+
+    conn->rto = (int)(conn->rttSmoothed + 4 * conn->rttVariance + 1);
+    if(conn->rto < conn->minRto) conn->rto = conn->minRto;
+    if(conn->rto > MAX_RTO) conn->rto = MAX_RTO;
+}
+
+// Exponential backoff after a loss, until a clean sample arrives.
+void backoffRto(LinkConnection *conn){
+    conn->rto *= 2;
+    if(conn->rto > MAX_RTO) conn->rto = MAX_RTO;
+}
+
+void recordFrameOutcome(LinkConnection *conn, int frameBytes, int failed){
+    if(conn->ferFrameBytes == 0) conn->ferFrameBytes = frameBytes;
+    conn->ferFrameBytes += (frameBytes - conn->ferFrameBytes) / FER_SMOOTHING;
+    conn->ferEstimate += ((failed ? 1.0 : 0.0) - conn->ferEstimate) / FER_SMOOTHING;
+}
+
+int sendFrame(LinkConnection *conn, unsigned char adress, unsigned char control){
     unsigned char buf[5] = {FLAG, adress, control, adress ^ control, FLAG};
-    int byteswritten = write(fd, buf, 5);
+    PROFILE_START(timer);
+    int byteswritten = transportWrite(&conn->transport, buf, 5);
+    PROFILE_STOP(ProfileWrite, timer);
+    if(byteswritten > 0){
+        conn->statistics.lineBytesSent += byteswritten;
+        lineQueue(conn, byteswritten);
+    }
     return byteswritten;
 }
 
 
+// Sends a supervision/unnumbered frame with an information field, protected by CRC-16.
+int sendInfoFrame(LinkConnection *conn, unsigned char adress, unsigned char control, const unsigned char *info, int infoSize){
+    unsigned char frame[MAX_FRAME_SIZE(MAX_CAPS_SIZE)];
+    frame[0] = FLAG;
+    frame[1] = adress;
+    frame[2] = control;
+    frame[3] = adress ^ control;
+
+    int size = 4 + stuffBytes(info, infoSize, frame + 4);
+    unsigned char crc[MAX_FCS_SIZE];
+    fcsFinal(FcsCrc16, fcsUpdate(FcsCrc16, fcsInit(FcsCrc16), info, infoSize), crc);
+    size += stuffBytes(crc, fcsSize(FcsCrc16), frame + size);
+    frame[size++] = FLAG;
+
+    conn->statistics.lineBytesSent += size;
+    lineQueue(conn, size);
+    return transportWrite(&conn->transport, frame, size);
+}
+
+// Writes the TLV block offered in SET or agreed in UA.
+// Returns its size.
+int buildCapabilities(const LinkLayer *params, unsigned char *caps){
+    int size = 0;
+
+    caps[size++] = CAP_MAX_PAYLOAD;
+    caps[size++] = 4;
+    for(int shift = 24; shift >= 0; shift -= 8) caps[size++] = (params->maxPayloadSize >> shift) & 0xFF;
+
+    caps[size++] = CAP_WINDOW;
+    caps[size++] = 1;
+    caps[size++] = params->windowSize;
+
+    caps[size++] = CAP_ARQ;
+    caps[size++] = 1;
+    caps[size++] = params->arqMode;
+
+    caps[size++] = CAP_FCS;
+    caps[size++] = 1;
+    caps[size++] = params->fcsType;
+
+    caps[size++] = CAP_COMPRESSION;
+    caps[size++] = 1;
+    caps[size++] = params->compression;
+
+    caps[size++] = CAP_DUPLEX;
+    caps[size++] = 1;
+    caps[size++] = params->duplex;
+
+    caps[size++] = CAP_FEC;
+    caps[size++] = 1;
+    caps[size++] = params->fec;
+
+    return size;
+}
+
+// Checks the CRC of a destuffed SET/UA information field and reads its TLVs
+// into params. Unknown types are skipped.
+// Return "1" if the block was valid.
+int readCapabilities(DestuffState *info, LinkLayer *params){
+    if(destuffOverflow(info) || info->size > info->capacity || info->size < fcsSize(FcsCrc16)) return 0;
+    if(!fcsCheck(FcsCrc16, fcsUpdate(FcsCrc16, fcsInit(FcsCrc16), info->out, info->size))) return 0;
+
+    const unsigned char *caps = info->out;
+    int size = info->size - fcsSize(FcsCrc16);
+    for(int i = 0; i + 2 <= size && i + 2 + caps[i + 1] <= size; i += 2 + caps[i + 1]){
+        const unsigned char *value = caps + i + 2;
+        int length = caps[i + 1];
+        if(length < 1) continue;
+
+        switch(caps[i]){
+            case CAP_MAX_PAYLOAD:{
+                if(length != 4) break;
+                params->maxPayloadSize = value[0] << 24 | value[1] << 16 | value[2] << 8 | value[3];
+                break;
+            }
+            case CAP_WINDOW: params->windowSize = value[0]; break;
+            case CAP_ARQ: params->arqMode = value[0]; break;
+            case CAP_FCS: params->fcsType = value[0]; break;
+            case CAP_COMPRESSION: params->compression = value[0]; break;
+            case CAP_DUPLEX: params->duplex = value[0]; break;
+            case CAP_FEC: params->fec = value[0]; break;
+            default: break;
+        }
+    }
+    return 1;
+}
+
+// Keeps in params what both sides support: the smaller sizes, the weaker
+// ARQ and FCS, and compression, full duplex and FEC only if both offer them.
+void agreeCapabilities(LinkLayer *params, const LinkLayer *peer){
+    if(peer->maxPayloadSize < params->maxPayloadSize) params->maxPayloadSize = peer->maxPayloadSize;
+    if(peer->windowSize < params->windowSize) params->windowSize = peer->windowSize;
+    if(peer->arqMode < params->arqMode) params->arqMode = peer->arqMode;
+    if(peer->fcsType < params->fcsType) params->fcsType = peer->fcsType;
+    params->compression = params->compression && peer->compression;
+    params->duplex = params->duplex && peer->duplex;
+    params->fec = params->fec && peer->fec;
+
+    if(params->maxPayloadSize < MIN_PAYLOAD_SIZE) params->maxPayloadSize = MIN_PAYLOAD_SIZE;
+    if(params->maxPayloadSize > MAX_PAYLOAD_LIMIT) params->maxPayloadSize = MAX_PAYLOAD_LIMIT;
+    if(params->windowSize < 1) params->windowSize = 1;
+    if(params->windowSize > SEQ_MODULO - 1) params->windowSize = SEQ_MODULO - 1;
+    if(params->arqMode > ArqSelectiveRepeat) params->arqMode = ArqSelectiveRepeat;
+    if(params->fcsType > FcsCrc32) params->fcsType = FcsCrc32;
+}
+
+// Refills the (empty) receive buffer with a single read().
+// Waits up to timeoutMs for data (-1 waits forever) or for the retransmission
+// timer, which sets timerExpired.
+// Return "1" if data was read, "0" on timeout, when the timer fired or once
+// the line hung up, which sets lineDown.
+int fillRxBuffer(LinkConnection *conn, int timeoutMs){
+    // the thread reading the line for pumpLine lets the others in while it waits
+    int pumping = conn->pumping;
+    if(pumping) pthread_mutex_unlock(&conn->lock);
+    int ready = transportPoll(&conn->transport, conn->timerFd, timeoutMs);
+    if(pumping) pthread_mutex_lock(&conn->lock);
+
+    if(ready & 2){
+        uint64_t expirations;
+        if(read(conn->timerFd, &expirations, sizeof(expirations)) > 0){
+            conn->timerExpired = TRUE;
+            conn->timerCount++;
+            conn->statistics.timeouts++;
+            LOG_INFO("Timeout #%d\n", conn->timerCount);
+        }
+    }
+    // bytes still buffered are read first, the hang up counts once they are gone
+    int bytesread = 0;
+    if(ready & 1){
+        PROFILE_START(timer);
+        bytesread = transportRead(&conn->transport, conn->rxBuffer, RX_BUFFER_SIZE);
+        PROFILE_STOP(ProfileRead, timer);
+    }
+    if(bytesread <= 0){
+        // a line that reads as empty while readable is at its end, and one
+        // that fails to read will not come back either
+        int broken = (ready & 1) && (bytesread == 0 || (errno != EAGAIN && errno != EINTR));
+        if((ready & 4) || broken) conn->lineDown = TRUE;
+        return 0;
+    }
+    conn->statistics.lineBytesReceived += bytesread;
+    conn->rxBufferStart = 0;
+    conn->rxBufferEnd = bytesread;
+    return 1;
+}
+
+// Takes the next byte from the receive buffer, refilling it once it is empty.
+// Return "1" if a byte was read, "0" on timeout or when the timer fired.
+int readByte(LinkConnection *conn, unsigned char *byte, int timeoutMs){
+    if(conn->rxBufferStart == conn->rxBufferEnd && !fillRxBuffer(conn, timeoutMs)) return 0;
+    *byte = conn->rxBuffer[conn->rxBufferStart++];
+    return 1;
+}
+
+// Returns the open connection behind fd, locked, or NULL.
+// The two locks are never held together.
+LinkConnection *lockConnection(int fd){
+    if(fd < 0 || fd >= MAX_CONNECTIONS) return NULL;
+    pthread_mutex_lock(&connectionsLock);
+    LinkConnection *conn = connections[fd];
+    pthread_mutex_unlock(&connectionsLock);
+    if(conn == NULL) return NULL;
+
+    pthread_mutex_lock(&conn->lock);
+    if(!atomic_load(&conn->open)){
+        pthread_mutex_unlock(&conn->lock);
+        return NULL;
+    }
+    return conn;
+}
+
+// Gives the slot back to llopen and unlocks the connection.
+void releaseConnection(LinkConnection *conn){
+    atomic_store(&conn->open, FALSE);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Frees what openConnection allocated, keeping the statistics.
+void freeConnection(LinkConnection *conn){
+    for(int i = 0; i < SEQ_MODULO; i++){
+        free(conn->windowFrames[i].bytes);
+        free(conn->windowFrames[i].iov);
+        free(conn->rxFrames[i]);
+        free(conn->windowPayloads[i]);
+        conn->windowPayloads[i] = NULL;
+        conn->windowFrames[i].bytes = NULL;
+        conn->windowFrames[i].iov = NULL;
+        conn->rxFrames[i] = NULL;
+    }
+    free(conn->rxScratch);
+    free(conn->fecParity);
+    free(conn->fecFrame);
+    conn->rxScratch = NULL;
+    conn->fecParity = NULL;
+    conn->fecFrame = NULL;
+    if(conn->timerFd >= 0) close(conn->timerFd);
+    conn->timerFd = -1;
+}
+
 int llopen(LinkLayer connectionParameters){
-    int fd = serialPortConnection(connectionParameters);
+    // a slot never used, or else one whose connection was closed
+    pthread_mutex_lock(&connectionsLock);
+    int fd = -1;
+    for(int i = 0; i < MAX_CONNECTIONS && fd < 0; i++){
+        if(connections[i] != NULL) continue;
+        connections[i] = (LinkConnection*) calloc(1, sizeof(LinkConnection));
+        if(connections[i] == NULL) break;
+        pthread_mutex_init(&connections[i]->lock, NULL);
+        pthread_cond_init(&connections[i]->progress, NULL);
+        fd = i;
+    }
+    for(int i = 0; i < MAX_CONNECTIONS && fd < 0; i++){
+        if(connections[i] != NULL && !atomic_load(&connections[i]->open)) fd = i;
+    }
     if(fd < 0){
+        pthread_mutex_unlock(&connectionsLock);
+        LOG_ERROR("No free connection, %d are open\n", MAX_CONNECTIONS);
         return -1;
     }
+    LinkConnection *conn = connections[fd];
+    atomic_store(&conn->open, TRUE);
+    pthread_mutex_unlock(&connectionsLock);
 
-    nRetransmissions = connectionParameters.nRetransmissions;
-    timeout = connectionParameters.timeout;
-    llMachineState currentstate = START;
+    // everything after open starts from zero; held until the handshake is over
+    pthread_mutex_lock(&conn->lock);
+    memset(&conn->timerFd, 0, sizeof(*conn) - offsetof(LinkConnection, timerFd));
+    conn->timerFd = -1;
+
+    if(openConnection(conn, connectionParameters) < 0){
+        freeConnection(conn);
+        releaseConnection(conn);
+        return -1;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return fd;
+}
 
+// Return "0" on success or "-1" on error.
+int openConnection(LinkConnection *conn, LinkLayer connectionParameters){
+    if(serialPortConnection(conn, connectionParameters) < 0){
+        return -1;
+    }
+
+    conn->nRetransmissions = connectionParameters.nRetransmissions;
+    conn->timeout = connectionParameters.timeout;
+    conn->rto = conn->timeout;
+    conn->minRto = MIN_RTO;
+    conn->rttSamples = 0;
+    conn->lineBaudRate = connectionParameters.baudRate;
+    conn->lineFreeAt = 0;
+    conn->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if(conn->timerFd < 0){
+        perror("timerfd_create");
+        transportClose(&conn->transport);
+        return -1;
+    }
+    fcsTablesInit();
+    fecTablesInit();
+    memset(&conn->statistics, 0, sizeof(conn->statistics));
+    long long handshakeStart = currentTimeMs();
+
+    LinkLayer agreed = connectionParameters;
     switch (connectionParameters.role){
         case LlTx:{
-            currentstate = tx_llopen_machinestate(fd);
-            if(currentstate != STOP) return -1;
+            if(tx_llopen_machinestate(conn, &agreed) != STOP){
+                transportClose(&conn->transport);
+                return -1;
+            }
             break;
         }
 
         case LlRx:{
-            rx_llopen_machinestate(fd);
+            if(rx_llopen_machinestate(conn, &agreed) < 0){
+                transportClose(&conn->transport);
+                return -1;
+            }
             break;
         }
 
         default:{
+            transportClose(&conn->transport);
             return -1;
             break;
         }
     }
 
-    return fd;
+    conn->statistics.handshakeMs = currentTimeMs() - handshakeStart;
+    conn->windowSize = agreed.windowSize;
+    conn->arqMode = agreed.arqMode;
+    conn->fcsType = agreed.fcsType;
+    conn->maxPayload = agreed.maxPayloadSize;
+    conn->compression = agreed.compression;
+    conn->duplex = agreed.duplex;
+    conn->fec = agreed.fec;
+    if(conn->arqMode == ArqSelectiveRepeat && conn->windowSize > SEQ_MODULO / 2) conn->windowSize = SEQ_MODULO / 2;
+    // in full duplex an acknowledgement may queue behind a window of full
+    // frames going the other way, which the handshake's RTT knows nothing of
+    if(conn->duplex && conn->lineBaudRate > 0){
+        int windowMs = conn->windowSize * (conn->maxPayload + 6 + MAX_FCS_SIZE) * 10000LL / conn->lineBaudRate;
+        if(windowMs > conn->minRto) conn->minRto = windowMs;
+        if(conn->rto < conn->minRto) conn->rto = conn->minRto;
+    }
+    LOG_INFO("Agreed: payload %d, window %d, %s, FCS %d bytes, compression %s, %s duplex, FEC %s\n",
+           conn->maxPayload, conn->windowSize, conn->arqMode == ArqSelectiveRepeat ? "selective repeat" : "go-back-n",
+           fcsSize(conn->fcsType), conn->compression ? "on" : "off", conn->duplex ? "full" : "half",
+           conn->fec ? "on" : "off");
+
+    // a frame with parity is destuffed whole, FCS and parity included
+    int paritySize = conn->fec ? fecParitySize(conn->maxPayload + MAX_FCS_SIZE) : 0;
+    conn->rxCapacity = conn->fec ? conn->maxPayload + MAX_FCS_SIZE + paritySize : conn->maxPayload;
+    if(connectionParameters.role == LlTx || conn->duplex){
+        for(int i = 0; i < SEQ_MODULO; i++){
+            conn->windowFrames[i].bytes = (unsigned char*) malloc(MAX_FRAME_SIZE(conn->maxPayload + paritySize));
+            conn->windowFrames[i].iov = (struct iovec*) malloc(GATHER_IOV_SIZE(conn->maxPayload) * sizeof(struct iovec));
+            if(conn->fec) conn->windowPayloads[i] = (unsigned char*) malloc(conn->maxPayload);
+        }
+    }
+    if((conn->arqMode == ArqSelectiveRepeat && connectionParameters.role == LlRx) || conn->duplex){
+        for(int i = 0; i < SEQ_MODULO; i++){
+            conn->rxFrames[i] = (unsigned char*) malloc(conn->rxCapacity);
+        }
+    }
+    if(conn->duplex) conn->rxScratch = (unsigned char*) malloc(conn->rxCapacity);
+    if(conn->fec){
+        conn->fecParity = (unsigned char*) malloc(paritySize);
+        conn->fecFrame = (unsigned char*) malloc(conn->rxCapacity);
+    }
+
+    conn->openedAt = currentTimeMs();
+    return 0;
+}
+
+int llmaxpayload(int fd){
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    int maxPayload = conn->maxPayload;
+    pthread_mutex_unlock(&conn->lock);
+    return maxPayload;
+}
+
+int llcompression(int fd){
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    int compression = conn->compression;
+    pthread_mutex_unlock(&conn->lock);
+    return compression;
+}
+
+int llduplex(int fd){
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    int duplex = conn->duplex;
+    pthread_mutex_unlock(&conn->lock);
+    return duplex;
+}
+
+int llfec(int fd){
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    int fec = conn->fec;
+    pthread_mutex_unlock(&conn->lock);
+    return fec;
+}
+
+// A frame of B bytes survives with probability exp(-k * B); k comes from the
+// measured frame error rate at the mean frame length. The payload L that
+// maximizes L / (L + h) * exp(-k * (L + h)), h being the bytes every frame
+// costs besides its payload (header, FCS, flags and the RR), solves
+// L^2 + h * L - h / k = 0.
+// Frames at most double in size from one measurement to the next, so a
+// large agreed maximum is only reached once the line has proven clean.
+int lloptimalpayload(int fd){
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    int payload = optimalPayload(conn);
+    pthread_mutex_unlock(&conn->lock);
+    return payload;
+}
+
+int optimalPayload(LinkConnection *conn){
+    double limit = conn->ferFrameBytes > 0 ? 2 * conn->ferFrameBytes : ADAPTIVE_START_PAYLOAD;
+    if(limit > conn->maxPayload) limit = conn->maxPayload;
+
+    double payload = limit;
+    if(conn->ferEstimate > 0){
+        double fer = conn->ferEstimate < 0.99 ? conn->ferEstimate : 0.99;
+        double k = -log(1 - fer) / conn->ferFrameBytes;
+        double h = 6 + fcsSize(conn->fcsType) + 5;
+        payload = (-h + sqrt(h * h + 4 * h / k)) / 2;
+        if(payload > limit) payload = limit;
+    }
+
+    if(payload < MIN_ADAPTIVE_PAYLOAD) return MIN_ADAPTIVE_PAYLOAD;
+    return (int) payload;
+}
+
+// Decides whether the next I-frame carries parity: for FEC_PROBE_FRAMES
+// frames once the frame error rate is above FEC_ON_FER.
+// Return "1" if it does.
+int fecActive(LinkConnection *conn){
+    if(!conn->fec) return FALSE;
+    if(conn->fecFramesLeft == 0 && conn->ferEstimate > FEC_ON_FER){
+        LOG_INFO("FEC on, frame error rate %.3f\n", conn->ferEstimate);
+        conn->fecFramesLeft = FEC_PROBE_FRAMES;
+    }
+    if(conn->fecFramesLeft == 0) return FALSE;
+    conn->fecFramesLeft--;
+    return TRUE;
 }
 
 int llwrite(const unsigned char *buf, int bufSize, int fd)
 {
-    int tramaSize = bufSize + 6; // (F,A,C,BCC1, bufdata, BCC2, F)
-    unsigned char* informtrama = (unsigned char*) malloc(tramaSize);
-   
-    unsigned char BCC2 = 0;
-    for(int i = 0; i < bufSize; i++){
-        BCC2 ^= buf[i];
-    }
-
-    informtrama[0] = FLAG;
-    informtrama[1] = ADRESS1;
-    informtrama[2] = NS(tramaCtx);
-    informtrama[3] = informtrama[1] ^ informtrama[2];
-
-    int dataindx = 4;
-    for(int i = 0; i < bufSize; i++){
-        if(buf[i] == FLAG){
-            tramaSize++;
-            informtrama = realloc(informtrama, tramaSize);
-            informtrama[dataindx] = 0x7D; // FLAG for 0x7E
-            dataindx++;
-            informtrama[dataindx] = 0x5E;   
-            dataindx++;
-        }
-        else if(buf[i] == ESCAPE){
-            tramaSize++;
-            informtrama = realloc(informtrama, tramaSize);
-            informtrama[dataindx] = 0x7D; // FLAG for 0x7D
-            dataindx++;
-            informtrama[dataindx] = 0x5D; 
-            dataindx++;
-        }
-        else{
-            informtrama[dataindx] = buf[i];
-            dataindx++;
-        }
-    }
-
-    if(BCC2 == FLAG){
-        tramaSize++;
-        informtrama = realloc(informtrama, tramaSize);
-        informtrama[dataindx] = 0x7D; // FLAG for 0x7E
-        dataindx++;
-        informtrama[dataindx] = 0x5E;   
-        dataindx++;
-    }
-    else if(BCC2 == ESCAPE){
-        tramaSize++;
-        informtrama = realloc(informtrama, tramaSize);
-        informtrama[dataindx] = 0x7D; // FLAG for 0x7E
-        dataindx++;
-        informtrama[dataindx] = 0x5D;   
-        dataindx++;
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    struct iovec iov = {(void*) buf, bufSize};
+    int written = sendIFrame(conn, &iov, 1, FALSE);
+    pthread_mutex_unlock(&conn->lock);
+    return written;
+}
+
+int llwritev(const struct iovec *iov, int iovcnt, int fd){
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    int written = sendIFrame(conn, iov, iovcnt, TRUE);
+    pthread_mutex_unlock(&conn->lock);
+    return written;
+}
+
+// Builds the next I-frame from the payload gathered in iov and sends it.
+// With reference set, long clean runs of the payload are not copied.
+int sendIFrame(LinkConnection *conn, const struct iovec *iov, int iovcnt, int reference){
+    if(waitForWindow(conn, conn->windowSize - 1) < 0) return -1;
+
+    int bufSize = 0;
+    for(int i = 0; i < iovcnt; i++) bufSize += iov[i].iov_len;
+    if(bufSize > conn->maxPayload) return -1;
+
+    // with FEC agreed the payload is kept, so a resend can add parity
+    struct iovec kept = {conn->windowPayloads[conn->tramaCtx], bufSize};
+    conn->windowPayloadSizes[conn->tramaCtx] = bufSize;
+    if(conn->fec){
+        unsigned char *dst = conn->windowPayloads[conn->tramaCtx];
+        for(int i = 0; i < iovcnt; i++){
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        iov = &kept;
+        iovcnt = 1;
+        reference = TRUE;
     }
-    else{
-        informtrama[dataindx] = BCC2;
-        dataindx++;
+
+    int fec = parityAllowed(conn, conn->tramaCtx) && fecActive(conn);
+    int tramaSize = buildIFrame(conn, conn->tramaCtx, iov, iovcnt, reference, fec);
+    GatherFrame *informtrama = &conn->windowFrames[conn->tramaCtx];
+
+    if(writeFrame(conn, informtrama) < 0){
+        LOG_ERROR("Error writing trama\n");
+        return -1;
     }
-    informtrama[dataindx] = FLAG;
-    
-    int nRetransmissions_aux = nRetransmissions;
-    int rej = 0;
-    int acc = 0;
-
-    while(nRetransmissions_aux > 0){
-        alarmEnabled = TRUE;
-        alarm(timeout);
-        rej = 0;
-        acc = 0;
-        while(alarmEnabled == TRUE && acc == 0 && rej == 0){
-           int byteswritten = write(fd, informtrama, tramaSize);
-
-           if (byteswritten < 0){
-                printf("Error writing trama\n");
-                exit(-1);
-            }
+    conn->statistics.framesSent++;
+    if(fec) conn->statistics.fecFrames++;
+    int dataSize = bufSize + fcsSize(conn->fcsType);
+    conn->statistics.stuffedBytes += tramaSize - (dataSize + (fec ? fecParitySize(dataSize) : 0) + 5);
 
-            unsigned char answer = trama_answer_machinestate(fd);
-            printf("Answer in hexadecimal: 0x%02X\n", answer);
+    conn->frameSentAt[conn->tramaCtx] = conn->lineFreeAt;
+    conn->frameRetransmitted[conn->tramaCtx] = FALSE;
 
-            if (answer == RR(0) || answer == RR(1)){
-                acc = 1;
-                tramaCtx = (tramaCtx + 1) % 2;
-            }
-            else if (answer == REJ(0) || answer == REJ(1)){
-                rej = 1;
+    if(conn->arqMode == ArqSelectiveRepeat){
+        conn->frameDeadlines[conn->tramaCtx] = conn->frameSentAt[conn->tramaCtx] + conn->rto;
+        conn->frameRetries[conn->tramaCtx] = conn->nRetransmissions;
+    }
+    // Window was empty: this frame starts the retransmission timer
+    else if(conn->tramaBase == conn->tramaCtx){
+        conn->nRetransmissions_left = conn->nRetransmissions;
+        setTimer(conn, conn->frameSentAt[conn->tramaCtx] + conn->rto);
+    }
+    conn->tramaCtx = (conn->tramaCtx + 1) % SEQ_MODULO;
+
+    return tramaSize;
+}
+
+// Stuffs the I-frame with N(s) ns and the payload gathered in iov into its
+// window slot: (F,A,C,BCC1, bufdata, FCS, [parity,] F). With reference set,
+// long clean runs of the payload are not copied.
+// Returns the frame length on the line.
+int buildIFrame(LinkConnection *conn, unsigned int ns, const struct iovec *iov, int iovcnt, int reference, int fec){
+    int bufSize = 0;
+    for(int i = 0; i < iovcnt; i++) bufSize += iov[i].iov_len;
+
+    GatherFrame *informtrama = &conn->windowFrames[ns];
+    unsigned char control = NS(ns) | (fec ? FEC_FLAG : 0);
+    unsigned char header[4] = {FLAG, ADRESS1, control, ADRESS1 ^ control};
+    gatherInit(informtrama);
+    gatherCopy(informtrama, header, 4);
+
+    // the parity covers the FCS too, so a bad byte in it can be repaired
+    FecEncoder encoder;
+    int dataSize = bufSize + fcsSize(conn->fcsType);
+    int paritySize = fec ? fecParitySize(dataSize) : 0;
+    if(fec) fecEncoderInit(&encoder, dataSize, conn->fecParity);
+
+    PROFILE_DECLARE(fcsTicks);
+    PROFILE_DECLARE(fecTicks);
+    PROFILE_DECLARE(stuffingTicks);
+    PROFILE_START(timer);
+    uint32_t fcs = fcsInit(conn->fcsType);
+    for(int j = 0; j < iovcnt; j++){
+        const unsigned char *buf = (const unsigned char*) iov[j].iov_base;
+        int size = iov[j].iov_len;
+        for(int i = 0; i < size; i += FCS_BLOCK_SIZE){
+            int blocksize = size - i < FCS_BLOCK_SIZE ? size - i : FCS_BLOCK_SIZE;
+            fcs = fcsUpdate(conn->fcsType, fcs, buf + i, blocksize);
+            PROFILE_LAP(fcsTicks, timer);
+            if(fec) fecEncode(&encoder, buf + i, blocksize);
+            PROFILE_LAP(fecTicks, timer);
+            gatherStuff(informtrama, buf + i, blocksize, reference);
+            PROFILE_LAP(stuffingTicks, timer);
+        }
+    }
+    PROFILE_RECORD(ProfileFcs, fcsTicks);
+    PROFILE_RECORD(ProfileStuffing, stuffingTicks);
+
+    unsigned char trailer[MAX_FCS_SIZE];
+    fcsFinal(conn->fcsType, fcs, trailer);
+    gatherStuff(informtrama, trailer, fcsSize(conn->fcsType), FALSE);
+    if(fec){
+        PROFILE_START(fecTimer);
+        fecEncode(&encoder, trailer, fcsSize(conn->fcsType));
+        PROFILE_LAP(fecTicks, fecTimer);
+        PROFILE_RECORD(ProfileFec, fecTicks);
+        gatherStuff(informtrama, conn->fecParity, paritySize, FALSE);
+    }
+    trailer[0] = FLAG;
+    gatherCopy(informtrama, trailer, 1);
+
+    conn->windowFrameSizes[ns] = informtrama->length;
+    return informtrama->length;
+}
+
+// In full duplex N(s) 7 with parity and N(r) 3 would read as a FLAG.
+// Return "1" if the frame with N(s) ns may carry parity.
+int parityAllowed(LinkConnection *conn, unsigned int ns){
+    return conn->fec && !(conn->duplex && ns == SEQ_MODULO - 1);
+}
+
+// A frame first sent without parity is rebuilt with it from the kept payload
+// if FEC has come on since, as the frames that fail are the ones to resend.
+void addParity(LinkConnection *conn, unsigned int ns){
+    if(!parityAllowed(conn, ns) || HAS_FEC(conn->windowFrames[ns].bytes[2]) || !fecActive(conn)) return;
+    struct iovec kept = {conn->windowPayloads[ns], conn->windowPayloadSizes[ns]};
+    buildIFrame(conn, ns, &kept, 1, TRUE, TRUE);
+    conn->statistics.fecFrames++;
+    LOG_DEBUG("Frame %u resent with parity\n", ns);
+}
+
+int writeFrame(LinkConnection *conn, GatherFrame *frame){
+    // in full duplex every I-frame, sent again or not, carries the N(r) of now
+    if(conn->duplex){
+        frame->bytes[2] = (frame->bytes[2] & (NS(7) | FEC_FLAG)) | PIGGYBACK(conn->tramaCrx);
+        frame->bytes[3] = ADRESS1 ^ frame->bytes[2];
+        conn->ackPending = FALSE;
+    }
+
+    PROFILE_START(timer);
+    for(int i = 0; i < frame->iovcnt; i += IOV_MAX){
+        int count = frame->iovcnt - i < IOV_MAX ? frame->iovcnt - i : IOV_MAX;
+        if(transportWritev(&conn->transport, frame->iov + i, count) < 0) return -1;
+    }
+    PROFILE_STOP(ProfileWrite, timer);
+    conn->statistics.lineBytesSent += frame->length;
+    lineQueue(conn, frame->length);
+    return frame->length;
+}
+
+// A write error fails only this connection, the process keeps serving the others.
+// Return "0" on success or "-1" on error.
+int retransmitWindow(LinkConnection *conn){
+    for(unsigned int i = conn->tramaBase; i != conn->tramaCtx; i = (i + 1) % SEQ_MODULO){
+        addParity(conn, i);
+        if(writeFrame(conn, &conn->windowFrames[i]) < 0){
+            LOG_ERROR("Error writing trama\n");
+            return -1;
+        }
+        conn->frameSentAt[i] = conn->lineFreeAt;
+        conn->frameRetransmitted[i] = TRUE;
+        conn->statistics.retransmissions++;
+    }
+    setTimer(conn, conn->lineFreeAt + conn->rto);
+    return 0;
+}
+
+int retransmitFrame(LinkConnection *conn, unsigned int ns){
+    addParity(conn, ns);
+    if(writeFrame(conn, &conn->windowFrames[ns]) < 0){
+        LOG_ERROR("Error writing trama\n");
+        return -1;
+    }
+    conn->frameSentAt[ns] = conn->lineFreeAt;
+    conn->frameRetransmitted[ns] = TRUE;
+    conn->frameDeadlines[ns] = conn->lineFreeAt + conn->rto;
+    conn->statistics.retransmissions++;
+    return 0;
+}
+
+// Cumulative acknowledgement: RR(nr) and REJ(nr) both confirm every frame before nr.
+// Returns the number of frames acknowledged, or "-1" if a retransmission failed.
+int handleAnswer(LinkConnection *conn, unsigned char answer){
+    unsigned int nr = GET_NR(answer);
+    unsigned int outstanding = (conn->tramaCtx - conn->tramaBase + SEQ_MODULO) % SEQ_MODULO;
+    unsigned int acked = (nr - conn->tramaBase + SEQ_MODULO) % SEQ_MODULO;
+
+    if(acked > outstanding) return 0; // stale answer
+
+    if(IS_SREJ(answer) || IS_REJ(answer)) conn->statistics.rejects++;
+
+    if(IS_SREJ(answer)){
+        if(acked < outstanding){
+            // a SREJ costs a retry like a timeout does, but one that comes
+            // sooner than half a round trip after the last resend was sent for
+            // an earlier copy and belongs to the same loss
+            int early = conn->frameRetransmitted[nr] && currentTimeMs() < conn->frameSentAt[nr] + conn->rttSmoothed / 2;
+            if(!early && --conn->frameRetries[nr] <= 0) return -1;
+            recordFrameOutcome(conn, conn->windowFrameSizes[nr], TRUE);
+            if(retransmitFrame(conn, nr) < 0) return -1;
+        }
+        return 0;
+    }
+
+    // payload only counts once the window slides past it, as it does on RX once delivered
+    for(unsigned int i = conn->tramaBase; i != nr; i = (i + 1) % SEQ_MODULO){
+        if(!conn->frameRetransmitted[i]) recordFrameOutcome(conn, conn->windowFrameSizes[i], FALSE);
+        conn->statistics.payloadBytes += conn->windowPayloadSizes[i];
+    }
+
+    // the newest frame acknowledged is the one this answer was sent for
+    unsigned int last = (nr + SEQ_MODULO - 1) % SEQ_MODULO;
+    if(acked > 0 && !conn->frameRetransmitted[last]) updateRto(conn, currentTimeMs() - conn->frameSentAt[last]);
+
+    if(acked > 0 && conn->arqMode == ArqSelectiveRepeat){
+        conn->tramaBase = nr;
+    }
+    else if(acked > 0){
+        conn->tramaBase = nr;
+        conn->nRetransmissions_left = conn->nRetransmissions;
+        long long startAt = conn->frameSentAt[conn->tramaBase] > currentTimeMs() ? conn->frameSentAt[conn->tramaBase] : currentTimeMs();
+        setTimer(conn, conn->tramaBase == conn->tramaCtx ? 0 : startAt + conn->rto);
+    }
+
+    if(IS_REJ(answer) && conn->tramaBase != conn->tramaCtx){
+        recordFrameOutcome(conn, conn->windowFrameSizes[conn->tramaBase], TRUE);
+        if(retransmitWindow(conn) < 0) return -1;
+        conn->nRetransmissions_left = conn->nRetransmissions;
+    }
+    return acked;
+}
+
+// Processes answers until at most maxOutstanding frames are unacknowledged.
+// Return "0" on success or "-1" when retransmissions are exhausted or the line failed.
+int waitForWindow(LinkConnection *conn, int maxOutstanding){
+    unsigned char answer;
+
+    // answers that are already waiting never cost a wait
+    int pumped;
+    while(conn->duplex && (pumped = pumpLine(conn, 0)) != 0){
+        if(pumped < 0) return -1;
+    }
+    while(!conn->duplex && (answer = trama_answer_machinestate(conn, 0)) != 0){
+        LOG_DEBUG("Answer in hexadecimal: 0x%02X\n", answer);
+        if(handleAnswer(conn, answer) < 0) return -1;
+    }
+
+    while((int)((conn->tramaCtx - conn->tramaBase + SEQ_MODULO) % SEQ_MODULO) > maxOutstanding){
+        if(conn->lineDown) return -1;
+        if(conn->arqMode == ArqSelectiveRepeat){
+            // resend whatever is due, then sleep until the earliest deadline
+            long long now = currentTimeMs();
+            long long next = 0;
+            int backedoff = FALSE;
+            for(unsigned int i = conn->tramaBase; i != conn->tramaCtx; i = (i + 1) % SEQ_MODULO){
+                if(conn->frameDeadlines[i] <= now){
+                    conn->frameRetries[i]--;
+                    if(conn->frameRetries[i] <= 0) return -1;
+                    LOG_DEBUG("Timeout on frame %u\n", i);
+                    recordFrameOutcome(conn, conn->windowFrameSizes[i], TRUE);
+                    if(!backedoff) backoffRto(conn);
+                    backedoff = TRUE;
+                    if(retransmitFrame(conn, i) < 0) return -1;
+                }
+                if(next == 0 || conn->frameDeadlines[i] < next) next = conn->frameDeadlines[i];
             }
-            else continue;  
+            setTimer(conn, next);
+        }
+        else if(conn->timerExpired){
+            conn->nRetransmissions_left--;
+            if(conn->nRetransmissions_left <= 0) return -1;
+            recordFrameOutcome(conn, conn->windowFrameSizes[conn->tramaBase], TRUE);
+            backoffRto(conn);
+            if(retransmitWindow(conn) < 0) return -1;
+        }
+
+        if(conn->duplex){
+            // no I-frame can carry the acknowledgement while the window is full
+            flushAck(conn);
+            PROFILE_START(timer);
+            pumped = pumpLine(conn, -1);
+            PROFILE_STOP(ProfileWaitAnswer, timer);
+            if(pumped < 0) return -1;
+            continue;
+        }
+
+        PROFILE_START(timer);
+        answer = trama_answer_machinestate(conn, -1);
+        PROFILE_STOP(ProfileWaitAnswer, timer);
+        if(answer != 0){
+            LOG_DEBUG("Answer in hexadecimal: 0x%02X\n", answer);
+            if(handleAnswer(conn, answer) < 0) return -1;
         }
-        if(acc) break;
-        else if(rej) nRetransmissions_aux = nRetransmissions;
-        else nRetransmissions_aux--;
     }
-    free(informtrama);
-    if(acc) return tramaSize;
-    else return -1;
+    if(conn->arqMode == ArqSelectiveRepeat) setTimer(conn, 0);
+    return 0;
 }
 
 int llread(unsigned char *packet, int fd){
-    unsigned char currbyte, field;
-    int currentidx = 0;
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    int size = readIFrame(conn, packet, 0, packet, conn->maxPayload);
+    pthread_mutex_unlock(&conn->lock);
+    return size;
+}
+
+int llreadinto(unsigned char *header, int headerSize, unsigned char *data, int dataCapacity, int fd){
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+    int size = readIFrame(conn, header, headerSize, data, dataCapacity);
+    pthread_mutex_unlock(&conn->lock);
+    return size;
+}
+
+int readIFrame(LinkConnection *conn, unsigned char *header, int headerSize, unsigned char *data, int dataCapacity){
+    unsigned char currbyte, field = 0;
     llMachineState currstate = START;
+
+    // in full duplex whichever call reads the line queues the frames
+    while(conn->duplex && conn->tramaDeliver == conn->tramaCrx){
+        if(pumpLine(conn, -1) < 0) return -1;
+    }
+
+    // Frames already received out of order and now in sequence, or queued
+    if(conn->tramaDeliver != conn->tramaCrx){
+        int size = conn->rxFrameSizes[conn->tramaDeliver];
+        if(size > headerSize + dataCapacity) size = headerSize + dataCapacity;
+        int n = size < headerSize ? size : headerSize;
+        memcpy(header, conn->rxFrames[conn->tramaDeliver], n);
+        memcpy(data, conn->rxFrames[conn->tramaDeliver] + n, size - n);
+        conn->tramaDeliver = (conn->tramaDeliver + 1) % SEQ_MODULO;
+        conn->statistics.framesReceived++;
+        conn->statistics.payloadBytes += size;
+        return size;
+    }
     
+    DestuffState destuff;
+    uint32_t fcs = 0;
+    int withParity = FALSE;
+
     while (currstate != STOP){
-        if (read(fd, &currbyte, 1) > 0){
+        if (currstate == READING_RCV){
+            // destuff everything buffered up to the closing FLAG in one go
+            if (conn->rxBufferStart == conn->rxBufferEnd && !fillRxBuffer(conn, -1)){
+                if (conn->lineDown) return -1;
+                continue;
+            }
+            int destuffed = destuff.size;
+            PROFILE_START(timer);
+            int consumed = destuffBytes(&destuff, conn->rxBuffer + conn->rxBufferStart, conn->rxBufferEnd - conn->rxBufferStart);
+            PROFILE_STOP(ProfileDestuffing, timer);
+            conn->rxBufferStart += consumed;
+            conn->statistics.stuffedBytes += consumed - (destuff.size - destuffed);
+            if (!withParity){
+                PROFILE_START(fcsTimer);
+                fcs = fcsUpdateDestuffed(conn->fcsType, &destuff, fcs, destuffed);
+                PROFILE_STOP(ProfileFcs, fcsTimer);
+            }
+            if (conn->rxBufferStart == conn->rxBufferEnd) continue;
+
+            conn->rxBufferStart++; // closing FLAG
+            if (destuff.size == 0){
+                currstate = FLAG_RCV;
+                continue;
+            }
+            if (destuffOverflow(&destuff)){
+                currstate = FLAG_RCV;
+                continue;
+            }
+
+            // the FCS went through the check too, so a good frame leaves the residue
+            int fcsOk = fcsCheck(conn->fcsType, fcs);
+            int currentidx = withParity ? checkFecFrame(conn, &destuff, &fcsOk) : destuff.size - fcsSize(conn->fcsType);
+            if (currentidx < 0 || currentidx > conn->maxPayload){
+                currstate = FLAG_RCV;
+                continue;
+            }
+            int size = handleIFrame(conn, field, &destuff, currentidx, fcsOk);
+            if(size > 0 && withParity){
+                // repaired in fecFrame, so it still has to go where the caller wants it
+                if(size > headerSize + dataCapacity) size = headerSize + dataCapacity;
+                int n = size < headerSize ? size : headerSize;
+                memcpy(header, conn->fecFrame, n);
+                memcpy(data, conn->fecFrame + n, size - n);
+            }
+            if(size > 0){
+                conn->statistics.framesReceived++;
+                conn->statistics.payloadBytes += size;
+            }
+            return size;
+        }
+        if (readByte(conn, &currbyte, -1)){
             switch (currstate){
                 case START:{
                     if (currbyte == FLAG) currstate = FLAG_RCV;
@@ -236,7 +1046,7 @@ int llread(unsigned char *packet, int fd){
                 }
                 case A_RCV:{
                     if (currbyte == FLAG) currstate = FLAG_RCV;
-                    else if (currbyte == NS(0) || currbyte == NS(1)){
+                    else if (IS_IFRAME(currbyte)){
                         currstate = C_RCV;
                         field = currbyte;
                     }
@@ -245,76 +1055,335 @@ int llread(unsigned char *packet, int fd){
                 }
                 case C_RCV:{
                     if (currbyte == FLAG) currstate = FLAG_RCV;
-                    else if (currbyte == (ADRESS1 ^ field)) currstate = READING_RCV;
-                    else currstate = START;
-                    break;
-                }
-                case READING_RCV:{
-                    if (currbyte == FLAG){
-                        unsigned char BCC2 = packet[currentidx - 1];
-                        currentidx--;
-                        unsigned char bccaux = 0;
-                        for(int i = 0; i < currentidx; i++) bccaux ^= packet[i];
-                        if(BCC2 == bccaux){
-                            currstate = STOP;
-                            if(NS(tramaCrx) != field){
-                                sendFrame(fd, ADRESS1, RR(tramaCrx));
-                                tramaCrx = (tramaCrx + 1) % 2;
-                                printf("mandei um receiver ready\n");
-                                return currentidx;
-                            }
-                            else{
-                                sendFrame(fd, ADRESS1, RR(tramaCrx));
-                                printf("mandei um receiver ready, trama repetida sem erros\n");
-                                return 0;
-                            }
-                        }
-                        else{
-                            if(NS(tramaCrx) != field){
-                                printf("mandei um reject\n");
-                                sendFrame(fd, ADRESS1, REJ(tramaCrx));
-                                return -1; 
-                            }
-                            else{
-                                printf("mandei receiver ready, trama repetida com erros\n");
-                                sendFrame(fd, ADRESS1, RR(tramaCrx));
-                                return 0; 
-                            }
-                        }
+                    else if (currbyte == (ADRESS1 ^ field)){
+                        currstate = READING_RCV;
+                        // a frame with parity can only be repaired once it is all in one place
+                        withParity = conn->fec && HAS_FEC(field);
+                        if (withParity) destuffInit(&destuff, conn->fecFrame, conn->rxCapacity);
+                        else destuffInitSplit(&destuff, header, headerSize, data, dataCapacity);
+                        fcs = fcsInit(conn->fcsType);
                     }
-                    else if (currbyte == ESCAPE) currstate = ESCAPE_RCV;
-                    else packet[currentidx++] = currbyte;
-                    break;
-                }
-                case ESCAPE_RCV:{
-                    unsigned char identifier = packet[1];
-                    printf("stufing no packet:  %d\n", identifier);
-                    currstate = READING_RCV;
-                    if(currbyte == 0x5E) packet[currentidx++] = FLAG;
-                    else if(currbyte == 0x5D) packet[currentidx++] = ESCAPE;
+                    else currstate = START;
                     break;
                 }
                 default:
                     break;
             }
         }
+        else if (conn->lineDown) return -1;
     }
     return -1;
 }
 
-int llclose(int fd, LinkLayer connectionParameters){
+// Checks a frame destuffed whole into frame->out, parity after the FCS. If the
+// FCS fails, the payload and FCS are repaired from the parity and checked again.
+// Sets fcsOk and returns the payload size, or "-1" if the frame cannot hold one.
+int checkFecFrame(LinkConnection *conn, const DestuffState *frame, int *fcsOk){
+    int dataSize = frame->size <= frame->capacity ? fecDataSize(frame->size) : -1;
+    int size = dataSize - fcsSize(conn->fcsType);
+    if(dataSize < 0 || size < 0) return -1;
+    conn->statistics.fecFrames++;
+
+    PROFILE_START(timer);
+    *fcsOk = fcsCheck(conn->fcsType, fcsUpdate(conn->fcsType, fcsInit(conn->fcsType), frame->out, dataSize));
+    PROFILE_STOP(ProfileFcs, timer);
+    if(*fcsOk) return size;
+
+    PROFILE_START(fecTimer);
+    int corrected = fecDecode(frame->out, dataSize, frame->out + dataSize);
+    PROFILE_STOP(ProfileFec, fecTimer);
+    if(corrected < 0) return size;
+    *fcsOk = fcsCheck(conn->fcsType, fcsUpdate(conn->fcsType, fcsInit(conn->fcsType), frame->out, dataSize));
+    if(*fcsOk){
+        LOG_DEBUG("FEC repaired %d bytes\n", corrected);
+        conn->statistics.fecCorrected++;
+    }
+    return size;
+}
+
+// Runs the bytes destuffed from position "from" onwards through the frame check
+// while they are still in cache.
+uint32_t fcsUpdateDestuffed(FcsType fcsType, const DestuffState *state, uint32_t fcs, int from){
+    int limit = state->headSize + state->capacity;
+    int end = state->size;
+    if(end > limit + DESTUFF_SPILL_SIZE) end = limit + DESTUFF_SPILL_SIZE;
+
+    if(from < state->headSize && from < end){
+        int last = end < state->headSize ? end : state->headSize;
+        fcs = fcsUpdate(fcsType, fcs, state->head + from, last - from);
+        from = last;
+    }
+    if(from < limit && from < end){
+        int last = end < limit ? end : limit;
+        fcs = fcsUpdate(fcsType, fcs, state->out + (from - state->headSize), last - from);
+        from = last;
+    }
+    if(from < end) fcs = fcsUpdate(fcsType, fcs, state->spill + (from - limit), end - from);
+    return fcs;
+}
+
+// Decides what to answer to a complete I-frame whose payload was destuffed by frame.
+// Returns the payload size if it should be delivered, or "0" for frames that
+// were discarded, buffered or asked for again: none of those fail the read.
+int handleIFrame(LinkConnection *conn, unsigned char control, const DestuffState *frame, int size, int bccOk){
+    unsigned int ns = GET_NS(control);
+    int ahead = (int) ((ns - conn->tramaCrx + SEQ_MODULO) % SEQ_MODULO);
+    if(!bccOk) conn->statistics.badFrames++;
+
+    if(conn->arqMode == ArqSelectiveRepeat){
+        if(ahead >= conn->windowSize){
+            LOG_DEBUG("mandei receiver ready, trama repetida\n");
+            conn->statistics.duplicates++;
+            sendFrame(conn, ADRESS1, RR(conn->tramaCrx));
+            return 0;
+        }
+        if(!bccOk){
+            LOG_DEBUG("mandei um selective reject\n");
+            conn->srejSent[ns] = TRUE;
+            conn->statistics.rejects++;
+            sendFrame(conn, ADRESS1, SREJ(ns));
+            return 0;
+        }
+        conn->srejSent[ns] = FALSE;
+        conn->rxFrameSizes[ns] = size;
+        if(ahead > 0){
+            // keep it and ask for the frames missing before it
+            if(frame->out != conn->rxFrames[ns]) destuffCopy(frame, conn->rxFrames[ns], size);
+            conn->rxFrameBuffered[ns] = TRUE;
+            for(unsigned int i = conn->tramaCrx; i != ns; i = (i + 1) % SEQ_MODULO){
+                if(conn->rxFrameBuffered[i] || conn->srejSent[i]) continue;
+                conn->srejSent[i] = TRUE;
+                conn->statistics.rejects++;
+                sendFrame(conn, ADRESS1, SREJ(i));
+            }
+            return 0;
+        }
+        // in sequence: it also releases every buffered frame after it
+        conn->tramaCrx = (conn->tramaCrx + 1) % SEQ_MODULO;
+        if(!conn->duplex) conn->tramaDeliver = conn->tramaCrx;
+        while(conn->rxFrameBuffered[conn->tramaCrx]){
+            conn->rxFrameBuffered[conn->tramaCrx] = FALSE;
+            conn->tramaCrx = (conn->tramaCrx + 1) % SEQ_MODULO;
+        }
+        acknowledgeFrames(conn);
+        LOG_DEBUG("mandei um receiver ready\n");
+        return size;
+    }
+
+    if(bccOk && ahead == 0){
+        conn->rxFrameSizes[ns] = size;
+        conn->tramaCrx = (conn->tramaCrx + 1) % SEQ_MODULO;
+        conn->rejSent = FALSE;
+        acknowledgeFrames(conn);
+        LOG_DEBUG("mandei um receiver ready\n");
+        return size;
+    }
+    else if(ahead == 0 || (ahead < conn->windowSize && !conn->rejSent)){
+        // expected frame corrupted, or first frame after a gap
+        conn->rejSent = TRUE;
+        conn->statistics.rejects++;
+        LOG_DEBUG("mandei um reject\n");
+        sendFrame(conn, ADRESS1, REJ(conn->tramaCrx));
+        return 0;
+    }
+    else if(ahead < conn->windowSize){
+        // rest of the window after a gap, already rejected
+        return 0;
+    }
+    else{
+        LOG_DEBUG("mandei receiver ready, trama repetida\n");
+        conn->statistics.duplicates++;
+        sendFrame(conn, ADRESS1, RR(conn->tramaCrx));
+        return 0;
+    }
+}
+
+// Acknowledges every frame received in sequence. In full duplex, while this
+// end has I-frames in flight, the next one may carry N(r) instead if it goes
+// out within ACK_DELAY.
+void acknowledgeFrames(LinkConnection *conn){
+    if(conn->duplex && conn->tramaBase != conn->tramaCtx){
+        if(!conn->ackPending) conn->ackDeadline = currentTimeMs() + ACK_DELAY;
+        conn->ackPending = TRUE;
+        return;
+    }
+    conn->ackPending = FALSE;
+    sendFrame(conn, ADRESS1, RR(conn->tramaCrx));
+}
+
+// Sends as an RR the acknowledgement no I-frame carried.
+void flushAck(LinkConnection *conn){
+    if(conn->ackPending) sendFrame(conn, ADRESS1, RR(conn->tramaCrx));
+    conn->ackPending = FALSE;
+}
+
+// Full duplex: reads frames of either kind off the line until one was
+// handled, the timer fired or timeoutMs (-1 for none) passed. One thread at
+// a time reads the line and lets go of the connection while it waits, so an
+// llwrite and an llread can both be waiting on it; the others sleep until
+// that thread handled something.
+// Return "1" if a frame was handled, "0" if not or "-1" if a retransmission
+// failed or the line hung up.
+int pumpLine(LinkConnection *conn, int timeoutMs){
+    if(conn->pumping){
+        if(timeoutMs != 0) pthread_cond_wait(&conn->progress, &conn->lock);
+        return 0;
+    }
+
+    conn->pumping = TRUE;
+    int timers = conn->timerCount;
+    long long until = currentTimeMs() + timeoutMs;
+    int handled = 0;
+    while(handled == 0){
+        if(conn->rxBufferStart == conn->rxBufferEnd){
+            long long now = currentTimeMs();
+            if(conn->ackPending && conn->ackDeadline <= now) flushAck(conn);
+            int wait = timeoutMs < 0 ? -1 : (until > now ? until - now : 0);
+            if(conn->ackPending && (wait < 0 || conn->ackDeadline - now < wait)) wait = conn->ackDeadline - now;
+
+            if(!fillRxBuffer(conn, wait)){
+                if(conn->lineDown){
+                    handled = -1;
+                    break;
+                }
+                if(conn->timerCount != timers) break;
+                if(timeoutMs >= 0 && currentTimeMs() >= until) break;
+                continue;
+            }
+        }
+        handled = parseDuplexFrame(conn);
+    }
+    conn->pumping = FALSE;
+    pthread_cond_broadcast(&conn->progress);
+    return handled;
+}
+
+// Full duplex: consumes buffered bytes until they run out or a frame was handled.
+// An I-frame is kept in its rxFrames slot and its N(r) taken as an RR.
+// Return "1" if a frame was handled, "0" if more bytes are needed or "-1" if
+// a retransmission failed.
+int parseDuplexFrame(LinkConnection *conn){
+    while(conn->rxBufferStart != conn->rxBufferEnd){
+        if(conn->answerState == READING_RCV){
+            DestuffState *destuff = &conn->frameDestuff;
+            int destuffed = destuff->size;
+            PROFILE_START(timer);
+            int consumed = destuffBytes(destuff, conn->rxBuffer + conn->rxBufferStart, conn->rxBufferEnd - conn->rxBufferStart);
+            PROFILE_STOP(ProfileDestuffing, timer);
+            conn->rxBufferStart += consumed;
+            conn->statistics.stuffedBytes += consumed - (destuff->size - destuffed);
+            unsigned char control = conn->answerControl;
+            int withParity = conn->fec && HAS_FEC(control);
+            if(!withParity){
+                PROFILE_START(fcsTimer);
+                conn->frameFcs = fcsUpdateDestuffed(conn->fcsType, destuff, conn->frameFcs, destuffed);
+                PROFILE_STOP(ProfileFcs, fcsTimer);
+            }
+            if(conn->rxBufferStart == conn->rxBufferEnd) return 0;
+
+            conn->rxBufferStart++; // closing FLAG
+            conn->answerState = FLAG_RCV;
+            if(destuff->size == 0 || destuffOverflow(destuff)) continue;
+            int fcsOk = fcsCheck(conn->fcsType, conn->frameFcs);
+            int size = withParity ? checkFecFrame(conn, destuff, &fcsOk) : destuff->size - fcsSize(conn->fcsType);
+            if(size < 0 || size > conn->maxPayload) continue;
+
+            if(fcsOk && handleAnswer(conn, RR(GET_NR(control))) < 0) return -1;
+
+            // nowhere to keep it until llread catches up: it comes again after a timeout
+            int ahead = (int) ((GET_NS(control) - conn->tramaCrx + SEQ_MODULO) % SEQ_MODULO);
+            if(destuff->out == conn->rxScratch && ahead < conn->windowSize) return 1;
+
+            LOG_DEBUG("I-frame %d, N(r) %d\n", GET_NS(control), GET_NR(control));
+            handleIFrame(conn, control, destuff, size, fcsOk);
+            return 1;
+        }
+
+        unsigned char currbyte = conn->rxBuffer[conn->rxBufferStart++];
+        switch(conn->answerState){
+            case START:{
+                if(currbyte == FLAG) conn->answerState = FLAG_RCV;
+                break;
+            }
+            case FLAG_RCV:{
+                if(currbyte != FLAG){
+                    if(currbyte == ADRESS1) conn->answerState = A_RCV;
+                    else conn->answerState = START;
+                }
+                break;
+            }
+            case A_RCV:{
+                if(currbyte == FLAG) conn->answerState = FLAG_RCV;
+                else if(IS_IFRAME(currbyte) || IS_RR(currbyte) || IS_REJ(currbyte) || IS_SREJ(currbyte)){
+                    conn->answerState = C_RCV;
+                    conn->answerControl = currbyte;
+                }
+                else conn->answerState = START;
+                break;
+            }
+            case C_RCV:{
+                if(currbyte == FLAG) conn->answerState = FLAG_RCV;
+                else if(currbyte != (ADRESS1 ^ conn->answerControl)) conn->answerState = START;
+                else if(IS_IFRAME(conn->answerControl)){
+                    // straight into its slot, unless that still holds a frame
+                    unsigned int ns = GET_NS(conn->answerControl);
+                    unsigned int queued = (conn->tramaCrx - conn->tramaDeliver + SEQ_MODULO) % SEQ_MODULO;
+                    int taken = (ns - conn->tramaDeliver + SEQ_MODULO) % SEQ_MODULO < queued || conn->rxFrameBuffered[ns];
+                    destuffInit(&conn->frameDestuff, taken ? conn->rxScratch : conn->rxFrames[ns], conn->rxCapacity);
+                    conn->frameFcs = fcsInit(conn->fcsType);
+                    conn->answerState = READING_RCV;
+                }
+                else conn->answerState = BCC_OK;
+                break;
+            }
+            case BCC_OK:{
+                conn->answerState = START;
+                if(currbyte == FLAG){
+                    LOG_DEBUG("Answer in hexadecimal: 0x%02X\n", conn->answerControl);
+                    return handleAnswer(conn, conn->answerControl) < 0 ? -1 : 1;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+int llclose(int fd, LinkLayer connectionParameters, int showStatistics){
+    LinkConnection *conn = lockConnection(fd);
+    if(conn == NULL) return -1;
+
+    // the line is let go whether or not DISC got through
+    int result = closeConnection(conn, connectionParameters, showStatistics);
+    if(transportClose(&conn->transport) < 0) result = -1;
+    freeConnection(conn);
+    releaseConnection(conn);
+    return result;
+}
+
+// Return "0" on success or "-1" on error.
+int closeConnection(LinkConnection *conn, LinkLayer connectionParameters, int showStatistics){
     llMachineState currentstate = START;
 
     switch (connectionParameters.role){
         case LlTx:{
-            currentstate = tx_llclose_machinestate(fd);
+            if(waitForWindow(conn, 0) < 0) return -1;
+            flushAck(conn);
+            conn->statistics.transferMs = currentTimeMs() - conn->openedAt;
+            currentstate = tx_llclose_machinestate(conn);
             if(currentstate != STOP) return -1;
-            sendFrame(fd, ADRESS1, UA);
+            sendFrame(conn, ADRESS1, UA);
             break;
         }
 
         case LlRx:{
-            rx_llclose_machinestate(fd);
+            // in full duplex the frames this end sent get through before DISC
+            if(conn->duplex && waitForWindow(conn, 0) < 0) return -1;
+            flushAck(conn);
+            conn->statistics.transferMs = currentTimeMs() - conn->openedAt;
+            if(rx_llclose_machinestate(conn) < 0) return -1;
             break;
         }
 
@@ -324,7 +1393,77 @@ int llclose(int fd, LinkLayer connectionParameters){
         }
     }
 
-    return close(fd);
+    if(showStatistics){
+        printStatistics(&conn->statistics, &connectionParameters);
+        if(connectionParameters.statisticsFile[0] != '\0' &&
+           writeStatisticsJson(connectionParameters.statisticsFile, &conn->statistics, &connectionParameters) < 0){
+            perror("Error writing statistics");
+        }
+    }
+    return 0;
+}
+
+const LinkStatistics *llstatistics(int fd){
+    if(fd < 0 || fd >= MAX_CONNECTIONS) return NULL;
+    pthread_mutex_lock(&connectionsLock);
+    LinkConnection *conn = connections[fd];
+    pthread_mutex_unlock(&connectionsLock);
+    return conn != NULL ? &conn->statistics : NULL;
+}
+
+// Goodput in bit/s over the transfer, and as a fraction of the line rate.
+double statisticsGoodput(const LinkStatistics *statistics){
+    if(statistics->transferMs <= 0) return 0;
+    return statistics->payloadBytes * 8000.0 / statistics->transferMs;
+}
+
+void printStatistics(const LinkStatistics *statistics, const LinkLayer *params){
+    double goodput = statisticsGoodput(statistics);
+    logFlush();
+    printf("\n---------- Link statistics (%s) ----------\n", params->role == LlTx ? "tx" : "rx");
+    printf("I-frames %s: %lld\n", params->role == LlTx ? "sent" : "received",
+           params->role == LlTx ? statistics->framesSent : statistics->framesReceived);
+    printf("Retransmissions: %lld\n", statistics->retransmissions);
+    printf("REJ/SREJ: %lld\n", statistics->rejects);
+    printf("Timeouts: %lld\n", statistics->timeouts);
+    printf("Duplicate frames: %lld\n", statistics->duplicates);
+    printf("Frames with bad FCS: %lld\n", statistics->badFrames);
+    printf("Frames with FEC parity: %lld, repaired: %lld\n", statistics->fecFrames, statistics->fecCorrected);
+    printf("Stuffed bytes: %lld\n", statistics->stuffedBytes);
+    printf("Payload bytes: %lld\n", statistics->payloadBytes);
+    printf("Line bytes sent/received: %lld/%lld\n", statistics->lineBytesSent, statistics->lineBytesReceived);
+    printf("Handshake: %lld ms\n", statistics->handshakeMs);
+    printf("Transfer: %lld ms\n", statistics->transferMs);
+    printf("Goodput: %.0f bit/s, efficiency %.3f of %d baud\n", goodput, goodput / params->baudRate, params->baudRate);
+}
+
+int writeStatisticsJson(const char *path, const LinkStatistics *statistics, const LinkLayer *params){
+    FILE *file = fopen(path, "w");
+    if(file == NULL) return -1;
+
+    double goodput = statisticsGoodput(statistics);
+    fprintf(file, "{\n");
+    fprintf(file, "  \"role\": \"%s\",\n", params->role == LlTx ? "tx" : "rx");
+    fprintf(file, "  \"baudRate\": %d,\n", params->baudRate);
+    fprintf(file, "  \"framesSent\": %lld,\n", statistics->framesSent);
+    fprintf(file, "  \"framesReceived\": %lld,\n", statistics->framesReceived);
+    fprintf(file, "  \"retransmissions\": %lld,\n", statistics->retransmissions);
+    fprintf(file, "  \"rejects\": %lld,\n", statistics->rejects);
+    fprintf(file, "  \"timeouts\": %lld,\n", statistics->timeouts);
+    fprintf(file, "  \"duplicates\": %lld,\n", statistics->duplicates);
+    fprintf(file, "  \"badFrames\": %lld,\n", statistics->badFrames);
+    fprintf(file, "  \"fecFrames\": %lld,\n", statistics->fecFrames);
+    fprintf(file, "  \"fecCorrected\": %lld,\n", statistics->fecCorrected);
+    fprintf(file, "  \"stuffedBytes\": %lld,\n", statistics->stuffedBytes);
+    fprintf(file, "  \"payloadBytes\": %lld,\n", statistics->payloadBytes);
+    fprintf(file, "  \"lineBytesSent\": %lld,\n", statistics->lineBytesSent);
+    fprintf(file, "  \"lineBytesReceived\": %lld,\n", statistics->lineBytesReceived);
+    fprintf(file, "  \"handshakeMs\": %lld,\n", statistics->handshakeMs);
+    fprintf(file, "  \"transferMs\": %lld,\n", statistics->transferMs);
+    fprintf(file, "  \"goodput\": %.1f,\n", goodput);
+    fprintf(file, "  \"efficiency\": %.4f\n", goodput / params->baudRate);
+    fprintf(file, "}\n");
+    return fclose(file) == 0 ? 0 : -1;
 }
 
 
@@ -334,18 +1473,27 @@ int llclose(int fd, LinkLayer connectionParameters){
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-llMachineState tx_llopen_machinestate(int fd){
+llMachineState tx_llopen_machinestate(LinkConnection *conn, LinkLayer *params){
     llMachineState currentstate = START;
     unsigned char currbyte;
-    int nRetransmissions_aux = nRetransmissions;
+    int nRetransmissions_aux = conn->nRetransmissions;
+
+    long long sentAt = 0;
+    unsigned char caps[MAX_CAPS_SIZE];
+    unsigned char peerCaps[MAX_CAPS_SIZE]; // kept apart, caps goes out again with every SET
+    int capsSize = buildCapabilities(params, caps);
+    LinkLayer peer = *params;
+    peer.duplex = FALSE; // ends that predate them send no CAP_DUPLEX or CAP_FEC
+    peer.fec = FALSE;
+    DestuffState info;
 
-    (void)signal(SIGALRM, alarmHandler);
     while(nRetransmissions_aux > 0 && currentstate != STOP){
-        sendFrame(fd, ADRESS1, SET);
-        alarm(timeout);
-        alarmEnabled = TRUE;
-        while(alarmEnabled == TRUE && currentstate != STOP){
-            if(read(fd, &currbyte, 1) > 0){
+        if(sentAt != 0) backoffRto(conn);
+        sendInfoFrame(conn, ADRESS1, SET, caps, capsSize);
+        sentAt = conn->lineFreeAt;
+        setTimer(conn, sentAt + conn->rto);
+        while(conn->timerExpired == FALSE && currentstate != STOP){
+            if(readByte(conn, &currbyte, -1)){
             switch(currentstate){
                 case START:{
                     if(currbyte == FLAG) currentstate = FLAG_RCV;
@@ -371,8 +1519,26 @@ llMachineState tx_llopen_machinestate(int fd){
                     break;
                 }
                 case BCC_OK:{
-                    if(currbyte == FLAG) currentstate = STOP;
-                    else currentstate = START;
+                    // plain UA, or UA followed by the agreed capabilities
+                    if(currbyte == FLAG){
+                        params->duplex = FALSE;
+                        params->fec = FALSE;
+                        currentstate = STOP;
+                    }
+                    else{
+                        currentstate = READING_RCV;
+                        destuffInit(&info, peerCaps, MAX_CAPS_SIZE);
+                        destuffBytes(&info, &currbyte, 1);
+                    }
+                    break;
+                }
+                case READING_RCV:{
+                    if(currbyte != FLAG) destuffBytes(&info, &currbyte, 1);
+                    else if(readCapabilities(&info, &peer)){
+                        agreeCapabilities(params, &peer);
+                        currentstate = STOP;
+                    }
+                    else currentstate = FLAG_RCV;
                     break;
                 }
                 default:
@@ -382,15 +1548,27 @@ llMachineState tx_llopen_machinestate(int fd){
         }
         nRetransmissions_aux--;
     }
+    setTimer(conn, 0);
+
+    // SET/UA on the first try gives the first round-trip sample
+    if(currentstate == STOP && nRetransmissions_aux == conn->nRetransmissions - 1) updateRto(conn, currentTimeMs() - sentAt);
     return currentstate;
 }
 
-void rx_llopen_machinestate(int fd){
+// Return "0" once SET was answered or "-1" if the line hung up before SET came.
+int rx_llopen_machinestate(LinkConnection *conn, LinkLayer *params){
     llMachineState currentstate = START;
     unsigned char currbyte;
+    unsigned char caps[MAX_CAPS_SIZE];
+    unsigned char peerCaps[MAX_CAPS_SIZE];
+    LinkLayer peer = *params;
+    peer.duplex = FALSE; // ends that predate them send no CAP_DUPLEX or CAP_FEC
+    peer.fec = FALSE;
+    DestuffState info;
+    int withCaps = FALSE;
 
     while(currentstate != STOP){
-        if(read(fd, &currbyte, 1) > 0){
+        if(readByte(conn, &currbyte, -1)){
             switch(currentstate){
                 case START:{
                     if(currbyte == FLAG) currentstate = FLAG_RCV;
@@ -416,76 +1594,105 @@ void rx_llopen_machinestate(int fd){
                     break;
                 }
                 case BCC_OK:{
+                    // plain SET, or SET followed by the transmitter's capabilities
                     if(currbyte == FLAG) currentstate = STOP;
-                    else currentstate = START;
+                    else{
+                        currentstate = READING_RCV;
+                        destuffInit(&info, peerCaps, MAX_CAPS_SIZE);
+                        destuffBytes(&info, &currbyte, 1);
+                    }
+                    break;
+                }
+                case READING_RCV:{
+                    if(currbyte != FLAG) destuffBytes(&info, &currbyte, 1);
+                    else if(readCapabilities(&info, &peer)){
+                        agreeCapabilities(params, &peer);
+                        withCaps = TRUE;
+                        currentstate = STOP;
+                    }
+                    else currentstate = FLAG_RCV;
                     break;
                 }
                 default:
                     break;
             }
         }
+        else if (conn->lineDown) return -1;
+    }
+
+    if(withCaps) sendInfoFrame(conn, ADRESS1, UA, caps, buildCapabilities(params, caps));
+    else{
+        params->duplex = FALSE;
+        params->fec = FALSE;
+        sendFrame(conn, ADRESS1, UA);
     }
-    sendFrame(fd, ADRESS1, UA);
+    return 0;
 }
 
-unsigned char trama_answer_machinestate(int fd){
-    unsigned char currbyte, answer = 0;
-    llMachineState currentstate = START;
-    
-    while(currentstate != STOP && alarmEnabled == TRUE){
-        if(read(fd, &currbyte, 1) > 0){
-            switch(currentstate){
-                case START:{
-                    if(currbyte == FLAG) currentstate = FLAG_RCV;
-                    break;
-                }
-                case FLAG_RCV:{
-                    if(currbyte != FLAG){
-                        if(currbyte == ADRESS1) currentstate = A_RCV;
-                        else currentstate = START;
-                    }
-                    break;
-                }
-                case A_RCV:{
-                    if(currbyte == FLAG) currentstate = FLAG_RCV;
-                    else if(currbyte == RR(0) || currbyte == RR(1) || currbyte == REJ(0) || currbyte == REJ(1)) {
-                        currentstate = C_RCV;
-                        answer = currbyte;
-                    }
-                    else currentstate = START;
-                    break;
-                }
-                case C_RCV:{
-                    if(currbyte == FLAG) currentstate = FLAG_RCV;
-                    else if(currbyte == (ADRESS1 ^ answer)) currentstate = BCC_OK;
-                    else currentstate = START;
-                    break;
+// Consumes received bytes, waiting up to timeoutMs whenever none are buffered.
+// Returns the control field of a complete RR/REJ frame, or 0 if none arrived in time.
+unsigned char trama_answer_machinestate(LinkConnection *conn, int timeoutMs){
+    unsigned char currbyte;
+
+    while(readByte(conn, &currbyte, timeoutMs)){
+        switch(conn->answerState){
+            case START:{
+                if(currbyte == FLAG) conn->answerState = FLAG_RCV;
+                break;
+            }
+            case FLAG_RCV:{
+                if(currbyte != FLAG){
+                    if(currbyte == ADRESS1) conn->answerState = A_RCV;
+                    else conn->answerState = START;
                 }
-                case BCC_OK:{
-                    if(currbyte == FLAG) currentstate = STOP;
-                    else currentstate = START;
-                    break;
+                break;
+            }
+            case A_RCV:{
+                if(currbyte == FLAG) conn->answerState = FLAG_RCV;
+                else if(IS_RR(currbyte) || IS_REJ(currbyte) || IS_SREJ(currbyte)){
+                    conn->answerState = C_RCV;
+                    conn->answerControl = currbyte;
                 }
-                default:
-                    break;
+                else conn->answerState = START;
+                break;
             }
+            case C_RCV:{
+                if(currbyte == FLAG) conn->answerState = FLAG_RCV;
+                else if(currbyte == (ADRESS1 ^ conn->answerControl)) conn->answerState = BCC_OK;
+                else conn->answerState = START;
+                break;
+            }
+            case BCC_OK:{
+                conn->answerState = START;
+                if(currbyte == FLAG) return conn->answerControl;
+                break;
+            }
+            default:
+                break;
         }
     }
-    return answer;
+    return 0;
 }
 
-llMachineState tx_llclose_machinestate(int fd){
+// An I-frame that comes while closing was sent again because its
+// acknowledgement got lost. Nothing reads it any more, so it is only answered
+// with the N(s) expected next: a frame already received is acknowledged and
+// one that never was stays unacknowledged until its sender gives up.
+void answerLateIFrame(LinkConnection *conn){
+    conn->statistics.duplicates++;
+    sendFrame(conn, ADRESS1, RR(conn->tramaCrx));
+}
+
+llMachineState tx_llclose_machinestate(LinkConnection *conn){
     llMachineState currentstate = START;
-    unsigned char currbyte;
-    int nRetransmissions_aux = nRetransmissions;
+    unsigned char currbyte, adress = 0, control = 0;
+    int nRetransmissions_aux = conn->nRetransmissions;
 
-    (void) signal(SIGALRM, alarmHandler);
     while (nRetransmissions_aux > 0 && currentstate != STOP){
-        sendFrame(fd, ADRESS1, DISC);
-        alarm(TIMEOUT);
-        alarmEnabled = TRUE;
-        while (alarmEnabled == TRUE && currentstate != STOP){
-            if(read(fd, &currbyte, 1) > 0){
+        sendFrame(conn, ADRESS1, DISC);
+        setTimer(conn, conn->lineFreeAt + conn->rto);
+        while (conn->timerExpired == FALSE && currentstate != STOP){
+            if(readByte(conn, &currbyte, -1)){
                 switch (currentstate){
                     case START:{
                         if (currbyte == FLAG) currentstate = FLAG_RCV;
@@ -493,21 +1700,32 @@ llMachineState tx_llclose_machinestate(int fd){
                     }
                     case FLAG_RCV:{
                         if (currbyte != FLAG){
-                            if(currbyte == ADRESS2) currentstate = A_RCV;
+                            // in full duplex the receiver's I-frames come with ADRESS1
+                            if(currbyte == ADRESS2 || currbyte == ADRESS1){
+                                adress = currbyte;
+                                currentstate = A_RCV;
+                            }
                             else currentstate = START;
                         }
                         break;
                     }
                     case A_RCV:{
                         if (currbyte == FLAG) currentstate = FLAG_RCV;
-                        else if (currbyte == DISC) currentstate = C_RCV;
+                        else if ((adress == ADRESS2 && currbyte == DISC) || (adress == ADRESS1 && IS_IFRAME(currbyte))){
+                            control = currbyte;
+                            currentstate = C_RCV;
+                        }
                         else currentstate = START;
                         break;
                     }
                     case C_RCV:{
                         if (currbyte == FLAG) currentstate = FLAG_RCV;
-                        else if (currbyte == (ADRESS2 ^ DISC)) currentstate = BCC_OK;
-                        else currentstate = START;
+                        else if (currbyte != (adress ^ control)) currentstate = START;
+                        else if (IS_IFRAME(control)){
+                            answerLateIFrame(conn);
+                            currentstate = START;
+                        }
+                        else currentstate = BCC_OK;
                         break;
                     }
                     case BCC_OK:{
@@ -519,18 +1737,26 @@ llMachineState tx_llclose_machinestate(int fd){
                         break;
                 }
             }
+            else if (conn->lineDown) break;
         }
+        if (conn->lineDown) break;
         nRetransmissions_aux--;
     }
+    setTimer(conn, 0);
     return currentstate;
 }
 
-void rx_llclose_machinestate(int fd){
+// Answers DISC with DISC, then waits one RTO for the UA. A DISC that comes
+// again means the answer got lost, so it is answered again and the wait
+// restarts; no UA by the end of the wait means that one got lost instead.
+// Return "0" once DISC was answered or "-1" if the line hung up before DISC came.
+int rx_llclose_machinestate(LinkConnection *conn){
     llMachineState currentstate = START;
-    unsigned char currbyte;
+    unsigned char currbyte, control = 0;
+    int answered = FALSE;
 
     while(currentstate != STOP){
-        if(read(fd, &currbyte, 1) > 0){
+        if(readByte(conn, &currbyte, -1)){
             switch (currentstate){
                 case START:{
                     if (currbyte == FLAG) currentstate = FLAG_RCV;
@@ -545,25 +1771,41 @@ void rx_llclose_machinestate(int fd){
                 }
                 case A_RCV:{
                     if (currbyte == FLAG) currentstate = FLAG_RCV;
-                    else if (currbyte == DISC) currentstate = C_RCV;
+                    else if (currbyte == DISC || currbyte == UA || IS_IFRAME(currbyte)){
+                        control = currbyte;
+                        currentstate = C_RCV;
+                    }
                     else currentstate = START;
                     break;
                 }
                 case C_RCV:{
                     if (currbyte == FLAG) currentstate = FLAG_RCV;
-                    else if (currbyte == (ADRESS1 ^ DISC)) currentstate = BCC_OK;
-                    else currentstate = START;
+                    else if (currbyte != (ADRESS1 ^ control)) currentstate = START;
+                    else if (IS_IFRAME(control)){
+                        answerLateIFrame(conn);
+                        currentstate = START;
+                    }
+                    else currentstate = BCC_OK;
                     break;
                 }
                 case BCC_OK:{
-                    if (currbyte == FLAG) currentstate = STOP;
-                    else currentstate = START;
+                    if (currbyte != FLAG) currentstate = START;
+                    else if (control == UA) currentstate = answered ? STOP : FLAG_RCV;
+                    else{
+                        sendFrame(conn, ADRESS2, DISC);
+                        setTimer(conn, conn->lineFreeAt + conn->rto);
+                        answered = TRUE;
+                        currentstate = FLAG_RCV;
+                    }
                     break;
                 }
                 default:
                     break;
             }
         }
+        else if (conn->lineDown) break;
+        else if (answered && conn->timerExpired) break;
     }
-    sendFrame(fd, ADRESS2, DISC);
+    setTimer(conn, 0);
+    return answered ? 0 : -1;
 }
\ No newline at end of file
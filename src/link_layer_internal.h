@@ -0,0 +1,114 @@
+// Link layer internals, shared by nothing but link_layer.c.
+// Programs use the ll* calls declared in link_layer.h instead.
+
+#ifndef _LINK_LAYER_INTERNAL_H_
+#define _LINK_LAYER_INTERNAL_H_
+
+#include "link_layer.h"
+
+// State of one connection, behind the descriptor llopen returns.
+typedef struct LinkConnection LinkConnection;
+
+typedef enum
+{
+    START,
+    FLAG_RCV,
+    A_RCV,
+    C_RCV,
+    BCC_OK,
+    READING_RCV,
+    ESCAPE_RCV,
+    STOP,
+} llMachineState;
+
+LinkConnection *lockConnection(int fd);
+
+void releaseConnection(LinkConnection *conn);
+
+void freeConnection(LinkConnection *conn);
+
+int openConnection(LinkConnection *conn, LinkLayer connectionParameters);
+
+int closeConnection(LinkConnection *conn, LinkLayer connectionParameters, int showStatistics);
+
+// Opens the transport chosen in connectionParameters.
+// Return "0" on success or "-1" on error.
+int serialPortConnection(LinkConnection *conn, LinkLayer connectionParameters);
+
+long long currentTimeMs();
+
+long long lineQueue(LinkConnection *conn, int size);
+
+void setTimer(LinkConnection *conn, long long deadlineMs);
+
+void updateRto(LinkConnection *conn, long long sampleMs);
+
+void backoffRto(LinkConnection *conn);
+
+void recordFrameOutcome(LinkConnection *conn, int frameBytes, int failed);
+
+int optimalPayload(LinkConnection *conn);
+
+int fecActive(LinkConnection *conn);
+
+int sendFrame(LinkConnection *conn, unsigned char adress, unsigned char control);
+
+int sendInfoFrame(LinkConnection *conn, unsigned char adress, unsigned char control, const unsigned char *info, int infoSize);
+
+int buildCapabilities(const LinkLayer *params, unsigned char *caps);
+
+int readCapabilities(DestuffState *info, LinkLayer *params);
+
+void agreeCapabilities(LinkLayer *params, const LinkLayer *peer);
+
+int fillRxBuffer(LinkConnection *conn, int timeoutMs);
+
+int readByte(LinkConnection *conn, unsigned char *byte, int timeoutMs);
+
+llMachineState tx_llopen_machinestate(LinkConnection *conn, LinkLayer *params);
+
+int rx_llopen_machinestate(LinkConnection *conn, LinkLayer *params);
+
+unsigned char trama_answer_machinestate(LinkConnection *conn, int timeoutMs);
+
+int sendIFrame(LinkConnection *conn, const struct iovec *iov, int iovcnt, int reference);
+
+int buildIFrame(LinkConnection *conn, unsigned int ns, const struct iovec *iov, int iovcnt, int reference, int fec);
+
+int parityAllowed(LinkConnection *conn, unsigned int ns);
+
+void addParity(LinkConnection *conn, unsigned int ns);
+
+int writeFrame(LinkConnection *conn, GatherFrame *frame);
+
+int retransmitWindow(LinkConnection *conn);
+
+int retransmitFrame(LinkConnection *conn, unsigned int ns);
+
+int checkFecFrame(LinkConnection *conn, const DestuffState *frame, int *fcsOk);
+
+uint32_t fcsUpdateDestuffed(FcsType fcsType, const DestuffState *state, uint32_t fcs, int from);
+
+int readIFrame(LinkConnection *conn, unsigned char *header, int headerSize, unsigned char *data, int dataCapacity);
+
+int handleIFrame(LinkConnection *conn, unsigned char control, const DestuffState *frame, int size, int bccOk);
+
+int handleAnswer(LinkConnection *conn, unsigned char answer);
+
+void acknowledgeFrames(LinkConnection *conn);
+
+void flushAck(LinkConnection *conn);
+
+int pumpLine(LinkConnection *conn, int timeoutMs);
+
+int parseDuplexFrame(LinkConnection *conn);
+
+int waitForWindow(LinkConnection *conn, int maxOutstanding);
+
+void answerLateIFrame(LinkConnection *conn);
+
+llMachineState tx_llclose_machinestate(LinkConnection *conn);
+
+int rx_llclose_machinestate(LinkConnection *conn);
+
+#endif // _LINK_LAYER_INTERNAL_H_
@@ -0,0 +1,130 @@
+// Leveled logger implementation
+// The ring is a bounded multi-producer queue: each slot carries a sequence
+// number that tells producers and the writer whose turn it is, so the link
+// layer and the file reader thread can log without a lock. A full ring
+// drops the message instead of blocking.
+
+#include "logger.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+typedef struct
+{
+    atomic_uint sequence;
+    int length;
+    char text[LOG_MESSAGE_SIZE];
+} LogSlot;
+
+LogSlot logRing[LOG_RING_SIZE];
+atomic_uint logHead;   // next slot a producer claims
+atomic_uint logTail;   // next slot the writer prints
+atomic_uint logDropped;
+atomic_int logRunning;
+atomic_int logLevel = LOG_COMPILED_LEVEL;
+pthread_t logThread;
+
+const char *logLevelNames[] = {"error", "warn", "info", "debug"};
+
+void logSleep(int ms){
+    struct timespec interval = {0, ms * 1000000L};
+    nanosleep(&interval, NULL);
+}
+
+void *logWriterThread(void *arg){
+    (void) arg;
+    while(1){
+        unsigned int tail = atomic_load_explicit(&logTail, memory_order_relaxed);
+        LogSlot *slot = &logRing[tail & (LOG_RING_SIZE - 1)];
+        if(atomic_load_explicit(&slot->sequence, memory_order_acquire) == tail + 1){
+            fwrite(slot->text, 1, slot->length, stdout);
+            atomic_store_explicit(&slot->sequence, tail + LOG_RING_SIZE, memory_order_release);
+            atomic_store_explicit(&logTail, tail + 1, memory_order_release);
+            continue;
+        }
+
+        unsigned int dropped = atomic_exchange(&logDropped, 0);
+        if(dropped > 0) printf("[log] %u messages dropped\n", dropped);
+        fflush(stdout);
+        if(!atomic_load(&logRunning) && tail == atomic_load(&logHead)) break;
+        logSleep(LOG_FLUSH_INTERVAL);
+    }
+    return NULL;
+}
+
+void logInit(void){
+    if(atomic_load(&logRunning)) return;
+
+    const char *level = getenv("LINK_LOG_LEVEL");
+    if(level != NULL){
+        for(int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++){
+            if(strcasecmp(level, logLevelNames[i]) == 0) atomic_store(&logLevel, i);
+        }
+        if(level[0] >= '0' && level[0] <= '9') atomic_store(&logLevel, atoi(level));
+    }
+
+    for(unsigned int i = 0; i < LOG_RING_SIZE; i++) atomic_store(&logRing[i].sequence, i);
+    atomic_store(&logHead, 0);
+    atomic_store(&logTail, 0);
+    atomic_store(&logRunning, 1);
+    if(pthread_create(&logThread, NULL, logWriterThread, NULL) != 0){
+        atomic_store(&logRunning, 0);
+        return;
+    }
+    atexit(logShutdown);
+}
+
+void logFlush(void){
+    if(!atomic_load(&logRunning)) return;
+    while(atomic_load(&logTail) != atomic_load(&logHead)) logSleep(1);
+    fflush(stdout);
+}
+
+void logShutdown(void){
+    if(!atomic_load(&logRunning)) return;
+    atomic_store(&logRunning, 0);
+    pthread_join(logThread, NULL);
+}
+
+void logWrite(int level, const char *format, ...){
+    (void) level; // LOG_AT filters on it before the call
+    va_list args;
+    va_start(args, format);
+
+    if(!atomic_load_explicit(&logRunning, memory_order_relaxed)){
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&logHead, memory_order_relaxed);
+    LogSlot *slot;
+    while(1){
+        slot = &logRing[head & (LOG_RING_SIZE - 1)];
+        int ahead = (int) (atomic_load_explicit(&slot->sequence, memory_order_acquire) - head);
+        if(ahead == 0){
+            if(atomic_compare_exchange_weak(&logHead, &head, head + 1)) break;
+        }
+        else if(ahead < 0){
+            atomic_fetch_add(&logDropped, 1);
+            va_end(args);
+            return;
+        }
+        else head = atomic_load_explicit(&logHead, memory_order_relaxed);
+    }
+
+    int length = vsnprintf(slot->text, LOG_MESSAGE_SIZE, format, args);
+    if(length < 0) length = 0;
+    if(length >= LOG_MESSAGE_SIZE){
+        length = LOG_MESSAGE_SIZE - 1;
+        slot->text[length - 1] = '\n';
+    }
+    slot->length = length;
+    va_end(args);
+    atomic_store_explicit(&slot->sequence, head + 1, memory_order_release);
+}
@@ -0,0 +1,206 @@
+// Byte stuffing implementation
+
+#include "stuffing.h"
+#include "macros.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STUFFING_X86 1
+#include <immintrin.h>
+#endif
+
+int findSpecialScalar(const unsigned char *buf, int size){
+    for(int i = 0; i < size; i++){
+        if(buf[i] == FLAG || buf[i] == ESCAPE) return i;
+    }
+    return size;
+}
+
+#ifdef STUFFING_X86
+__attribute__((target("sse2")))
+int findSpecialSse2(const unsigned char *buf, int size){
+    const __m128i flag = _mm_set1_epi8((char) FLAG);
+    const __m128i escape = _mm_set1_epi8((char) ESCAPE);
+    int i = 0;
+
+    for(; i + 16 <= size; i += 16){
+        __m128i block = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, flag), _mm_cmpeq_epi8(block, escape));
+        unsigned int mask = _mm_movemask_epi8(hits);
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return i + findSpecialScalar(buf + i, size - i);
+}
+
+__attribute__((target("avx2")))
+int findSpecialAvx2(const unsigned char *buf, int size){
+    const __m256i flag = _mm256_set1_epi8((char) FLAG);
+    const __m256i escape = _mm256_set1_epi8((char) ESCAPE);
+    int i = 0;
+
+    for(; i + 32 <= size; i += 32){
+        __m256i block = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(block, flag), _mm256_cmpeq_epi8(block, escape));
+        unsigned int mask = _mm256_movemask_epi8(hits);
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return i + findSpecialSse2(buf + i, size - i);
+}
+#endif
+
+// First call picks the kernel for this CPU and replaces itself
+int findSpecialDispatch(const unsigned char *buf, int size){
+#ifdef STUFFING_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) findSpecial = findSpecialAvx2;
+    else if(__builtin_cpu_supports("sse2")) findSpecial = findSpecialSse2;
+    else findSpecial = findSpecialScalar;
+#else
+    findSpecial = findSpecialScalar;
+#endif
+    return findSpecial(buf, size);
+}
+
+int (*findSpecial)(const unsigned char *buf, int size) = findSpecialDispatch;
+
+int stuffBytes(const unsigned char *buf, int size, unsigned char *out){
+    int outsize = 0;
+    int i = 0;
+
+    while(i < size){
+        int run = findSpecial(buf + i, size - i);
+        memcpy(out + outsize, buf + i, run);
+        outsize += run;
+        i += run;
+        if(i == size) break;
+
+        out[outsize++] = ESCAPE; // 0x7E -> 0x7D 0x5E, 0x7D -> 0x7D 0x5D
+        out[outsize++] = buf[i++] ^ 0x20;
+    }
+    return outsize;
+}
+
+void gatherInit(GatherFrame *frame){
+    frame->iovcnt = 0;
+    frame->size = 0;
+    frame->length = 0;
+}
+
+// Adds a piece to the iov list, growing the last entry when they are contiguous.
+void gatherAppend(GatherFrame *frame, const unsigned char *buf, int size){
+    if(size == 0) return;
+    frame->length += size;
+    if(frame->iovcnt > 0){
+        struct iovec *last = &frame->iov[frame->iovcnt - 1];
+        if((unsigned char*) last->iov_base + last->iov_len == buf){
+            last->iov_len += size;
+            return;
+        }
+    }
+    frame->iov[frame->iovcnt].iov_base = (void*) buf;
+    frame->iov[frame->iovcnt].iov_len = size;
+    frame->iovcnt++;
+}
+
+void gatherCopy(GatherFrame *frame, const unsigned char *buf, int size){
+    memcpy(frame->bytes + frame->size, buf, size);
+    gatherAppend(frame, frame->bytes + frame->size, size);
+    frame->size += size;
+}
+
+void gatherStuff(GatherFrame *frame, const unsigned char *buf, int size, int reference){
+    int i = 0;
+
+    while(i < size){
+        int run = findSpecial(buf + i, size - i);
+        if(reference && run >= STUFF_REF_MIN) gatherAppend(frame, buf + i, run);
+        else gatherCopy(frame, buf + i, run);
+        i += run;
+        if(i == size) break;
+
+        unsigned char escaped[2] = {ESCAPE, buf[i++] ^ 0x20};
+        gatherCopy(frame, escaped, 2);
+    }
+}
+
+void destuffInit(DestuffState *state, unsigned char *out, int capacity){
+    destuffInitSplit(state, NULL, 0, out, capacity);
+}
+
+void destuffInitSplit(DestuffState *state, unsigned char *head, int headSize, unsigned char *out, int capacity){
+    state->head = head;
+    state->headSize = headSize;
+    state->out = out;
+    state->capacity = capacity;
+    state->size = 0;
+    state->escaped = 0;
+}
+
+void destuffWrite(DestuffState *state, const unsigned char *bytes, int count){
+    if(state->size < state->headSize){
+        int n = count < state->headSize - state->size ? count : state->headSize - state->size;
+        memcpy(state->head + state->size, bytes, n);
+        state->size += n;
+        bytes += n;
+        count -= n;
+    }
+    int room = state->headSize + state->capacity - state->size;
+    if(room > 0){
+        int n = count < room ? count : room;
+        memcpy(state->out + state->size - state->headSize, bytes, n);
+        state->size += n;
+        bytes += n;
+        count -= n;
+    }
+    for(int i = 0; i < count; i++){
+        int spillidx = state->size - state->headSize - state->capacity;
+        if(spillidx < DESTUFF_SPILL_SIZE) state->spill[spillidx] = bytes[i];
+        state->size++;
+    }
+}
+
+int destuffBytes(DestuffState *state, const unsigned char *in, int size){
+    int i = 0;
+
+    while(i < size){
+        if(state->escaped){
+            if(in[i] == FLAG) return i;
+            unsigned char byte = in[i++] ^ 0x20;
+            destuffWrite(state, &byte, 1);
+            state->escaped = 0;
+            continue;
+        }
+
+        int run = findSpecial(in + i, size - i);
+        destuffWrite(state, in + i, run);
+        i += run;
+        if(i == size) break;
+        if(in[i] == FLAG) return i;
+
+        state->escaped = 1;
+        i++;
+    }
+    return i;
+}
+
+unsigned char destuffedByte(const DestuffState *state, int index){
+    if(index < state->headSize) return state->head[index];
+    index -= state->headSize;
+    if(index < state->capacity) return state->out[index];
+    return state->spill[index - state->capacity];
+}
+
+void destuffCopy(const DestuffState *state, unsigned char *dst, int size){
+    int n = size < state->headSize ? size : state->headSize;
+    if(n > 0) memcpy(dst, state->head, n);
+    dst += n;
+    size -= n;
+    n = size < state->capacity ? size : state->capacity;
+    memcpy(dst, state->out, n);
+    for(int i = n; i < size; i++) dst[i] = state->spill[i - state->capacity];
+}
+
+int destuffOverflow(const DestuffState *state){
+    return state->size > state->headSize + state->capacity + DESTUFF_SPILL_SIZE;
+}
@@ -0,0 +1,426 @@
+// Transport implementation.
+
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FALSE 0
+#define TRUE 1
+
+////////////////////////////////////////////////
+// DESCRIPTOR BACKENDS
+////////////////////////////////////////////////
+
+int fdRead(Transport *transport, unsigned char *buf, int size){
+    return read(transport->fd, buf, size);
+}
+
+// Sockets are written with MSG_NOSIGNAL so a closed peer is an error
+// instead of SIGPIPE.
+int fdWriteOnce(Transport *transport, const struct iovec *iov, int iovcnt){
+    if(transport->type != TransportSocket) return writev(transport->fd, iov, iovcnt);
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = (struct iovec *)iov;
+    message.msg_iovlen = iovcnt;
+    return sendmsg(transport->fd, &message, MSG_NOSIGNAL);
+}
+
+// writev, finishing piece by piece if it comes back short.
+int fdWritev(Transport *transport, const struct iovec *iov, int iovcnt){
+    int total = 0;
+    for(int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    int written = fdWriteOnce(transport, iov, iovcnt);
+    if(written < 0) return -1;
+
+    int skip = written;
+    for(int i = 0; i < iovcnt && written < total; i++){
+        if(skip >= (int)iov[i].iov_len){
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        const unsigned char *base = (const unsigned char *)iov[i].iov_base + skip;
+        int left = iov[i].iov_len - skip;
+        skip = 0;
+        while(left > 0){
+            struct iovec rest = {(void *)base, left};
+            int n = fdWriteOnce(transport, &rest, 1);
+            if(n < 0) return -1;
+            base += n;
+            left -= n;
+            written += n;
+        }
+    }
+    return written;
+}
+
+int fdClose(Transport *transport){
+    return close(transport->fd);
+}
+
+int serialOpen(Transport *transport, const char *name, int baudRate){
+    // Open serial port device for reading and writing and not as controlling tty
+    // because we don't want to get killed if linenoise sends CTRL-C.
+    transport->fd = open(name, O_RDWR | O_NOCTTY);
+    if(transport->fd < 0){
+        perror(name);
+        return -1;
+    }
+
+    // Save current port settings
+    if(tcgetattr(transport->fd, &transport->oldtio) == -1){
+        perror("tcgetattr");
+        close(transport->fd);
+        return -1;
+    }
+
+    // Clear struct for new port settings
+    struct termios newtio;
+    memset(&newtio, 0, sizeof(newtio));
+
+    newtio.c_cflag = baudRate | CS8 | CLOCAL | CREAD;
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+
+    // Set input mode (non-canonical, no echo,...)
+    newtio.c_lflag = 0;
+    newtio.c_cc[VTIME] = 0; // Inter-character timer unused
+    newtio.c_cc[VMIN] = 0;  // Read returns what is there, poll() does the waiting
+
+    // Now clean the line and activate the settings for the port
+    tcflush(transport->fd, TCIOFLUSH);
+
+    if(tcsetattr(transport->fd, TCSANOW, &newtio) == -1){
+        perror("tcsetattr");
+        close(transport->fd);
+        return -1;
+    }
+    return 0;
+}
+
+int serialClose(Transport *transport){
+    // Restore the old port settings
+    tcsetattr(transport->fd, TCSANOW, &transport->oldtio);
+    return close(transport->fd);
+}
+
+// Pseudo terminals ignore the line rate, so only raw mode is set.
+int ptyOpen(Transport *transport, const char *name, int baudRate){
+    (void) baudRate;
+    transport->fd = open(name, O_RDWR | O_NOCTTY);
+    if(transport->fd < 0){
+        perror(name);
+        return -1;
+    }
+
+    if(tcgetattr(transport->fd, &transport->oldtio) == -1){
+        perror("tcgetattr");
+        close(transport->fd);
+        return -1;
+    }
+
+    struct termios newtio = transport->oldtio;
+    cfmakeraw(&newtio);
+    newtio.c_cc[VTIME] = 0;
+    newtio.c_cc[VMIN] = 0;
+    tcflush(transport->fd, TCIOFLUSH);
+
+    if(tcsetattr(transport->fd, TCSANOW, &newtio) == -1){
+        perror("tcsetattr");
+        close(transport->fd);
+        return -1;
+    }
+    return 0;
+}
+
+int socketOpen(Transport *transport, const char *name, int baudRate){
+    (void) baudRate;
+    char *end;
+    long fd = strtol(name, &end, 10);
+    if(end == name || *end != '\0' || fd < 0){
+        fprintf(stderr, "%s: not a socket descriptor\n", name);
+        return -1;
+    }
+    transport->fd = fd;
+    return 0;
+}
+
+////////////////////////////////////////////////
+// MEMORY PIPE
+////////////////////////////////////////////////
+
+// One direction of a memory pipe; ring[side] is read by that side.
+// event counts while the ring has data or the writer closed, so poll() sees it readable.
+typedef struct
+{
+    unsigned char *data;
+    int size;
+    int head;
+    int count;
+    int event;
+} MemoryRing;
+
+struct MemoryPipe
+{
+    char name[MEMORY_PIPE_NAME_SIZE];
+    int users;
+    int closed[2];
+    pthread_mutex_t lock;
+    MemoryRing ring[2];
+    MemoryPipe *next;
+};
+
+MemoryPipe *memoryPipes = NULL;
+pthread_mutex_t memoryPipesLock = PTHREAD_MUTEX_INITIALIZER;
+
+void memoryFree(MemoryPipe *pipe){
+    for(int side = 0; side < 2; side++){
+        if(pipe->ring[side].event >= 0) close(pipe->ring[side].event);
+        free(pipe->ring[side].data);
+    }
+    pthread_mutex_destroy(&pipe->lock);
+    free(pipe);
+}
+
+// Makes the ring event readable, whether or not it already was.
+void memorySignal(MemoryRing *ring){
+    uint64_t one = 1;
+    if(write(ring->event, &one, sizeof(one)) < 0){
+        // counter full, already readable
+    }
+}
+
+// Doubles the ring until it has room for size more bytes, laying the data
+// out from the start again.
+// Return "0" on success or "-1" if out of memory.
+int memoryGrow(MemoryRing *ring, int size){
+    int newSize = ring->size;
+    while(newSize - ring->count < size) newSize *= 2;
+    if(newSize == ring->size) return 0;
+
+    unsigned char *data = (unsigned char *)malloc(newSize);
+    if(data == NULL) return -1;
+    int first = ring->size - ring->head < ring->count ? ring->size - ring->head : ring->count;
+    memcpy(data, ring->data + ring->head, first);
+    memcpy(data + first, ring->data, ring->count - first);
+    free(ring->data);
+    ring->data = data;
+    ring->size = newSize;
+    ring->head = 0;
+    return 0;
+}
+
+int memoryOpen(Transport *transport, const char *name, int baudRate){
+    (void) baudRate;
+    pthread_mutex_lock(&memoryPipesLock);
+
+    MemoryPipe *pipe = memoryPipes;
+    while(pipe != NULL && (pipe->users != 1 || pipe->closed[0] || strcmp(pipe->name, name) != 0)) pipe = pipe->next;
+
+    if(pipe != NULL){
+        transport->side = 1;
+        pipe->users = 2;
+    }
+    else{
+        pipe = (MemoryPipe *)calloc(1, sizeof(MemoryPipe));
+        if(pipe == NULL){
+            pthread_mutex_unlock(&memoryPipesLock);
+            return -1;
+        }
+        strncpy(pipe->name, name, MEMORY_PIPE_NAME_SIZE - 1);
+        pipe->users = 1;
+        pthread_mutex_init(&pipe->lock, NULL);
+        for(int side = 0; side < 2; side++){
+            pipe->ring[side].size = MEMORY_PIPE_SIZE;
+            pipe->ring[side].data = (unsigned char *)malloc(MEMORY_PIPE_SIZE);
+            pipe->ring[side].event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        if(pipe->ring[0].event < 0 || pipe->ring[1].event < 0 || pipe->ring[0].data == NULL || pipe->ring[1].data == NULL){
+            perror("eventfd");
+            memoryFree(pipe);
+            pthread_mutex_unlock(&memoryPipesLock);
+            return -1;
+        }
+        pipe->next = memoryPipes;
+        memoryPipes = pipe;
+        transport->side = 0;
+    }
+
+    transport->pipe = pipe;
+    transport->fd = pipe->ring[transport->side].event;
+    pthread_mutex_unlock(&memoryPipesLock);
+    return 0;
+}
+
+// Like read(): "0" once the other side closed and everything it wrote was
+// read, "-1" with EAGAIN while the ring is empty.
+int memoryRead(Transport *transport, unsigned char *buf, int size){
+    MemoryPipe *pipe = transport->pipe;
+    MemoryRing *ring = &pipe->ring[transport->side];
+
+    pthread_mutex_lock(&pipe->lock);
+    int n = size < ring->count ? size : ring->count;
+    int first = ring->size - ring->head < n ? ring->size - ring->head : n;
+    memcpy(buf, ring->data + ring->head, first);
+    memcpy(buf + first, ring->data, n - first);
+    ring->head = (ring->head + n) % ring->size;
+    ring->count -= n;
+
+    // a closed writer leaves it readable, so the end of the pipe is seen
+    int peerClosed = pipe->closed[1 - transport->side];
+    if(ring->count == 0 && !peerClosed){
+        uint64_t value;
+        if(read(ring->event, &value, sizeof(value)) < 0){
+            // already reset
+        }
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    if(n == 0 && !peerClosed){
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+// Never waits for the reader: the caller may hold a lock the reader needs, so
+// the ring grows instead. The link layer's window bounds how far it can grow.
+int memoryWritev(Transport *transport, const struct iovec *iov, int iovcnt){
+    MemoryPipe *pipe = transport->pipe;
+    int peer = 1 - transport->side;
+    MemoryRing *ring = &pipe->ring[peer];
+    int total = 0;
+    for(int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    pthread_mutex_lock(&pipe->lock);
+    if(pipe->closed[peer]){
+        pthread_mutex_unlock(&pipe->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    if(memoryGrow(ring, total) < 0){
+        pthread_mutex_unlock(&pipe->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(int i = 0; i < iovcnt; i++){
+        const unsigned char *base = (const unsigned char *)iov[i].iov_base;
+        int left = iov[i].iov_len;
+        while(left > 0){
+            int tail = (ring->head + ring->count) % ring->size;
+            int n = ring->size - tail < left ? ring->size - tail : left;
+            memcpy(ring->data + tail, base, n);
+            if(ring->count == 0) memorySignal(ring);
+            ring->count += n;
+            base += n;
+            left -= n;
+        }
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return total;
+}
+
+int memoryClose(Transport *transport){
+    MemoryPipe *pipe = transport->pipe;
+
+    pthread_mutex_lock(&memoryPipesLock);
+    pthread_mutex_lock(&pipe->lock);
+    pipe->closed[transport->side] = TRUE;
+    // wakes the other side, whose next read then sees the end of the pipe
+    memorySignal(&pipe->ring[1 - transport->side]);
+    pthread_mutex_unlock(&pipe->lock);
+
+    // the last user frees it
+    if(--pipe->users == 0){
+        MemoryPipe **link = &memoryPipes;
+        while(*link != pipe) link = &(*link)->next;
+        *link = pipe->next;
+        memoryFree(pipe);
+    }
+    pthread_mutex_unlock(&memoryPipesLock);
+    transport->pipe = NULL;
+    return 0;
+}
+
+////////////////////////////////////////////////
+// TRANSPORT
+////////////////////////////////////////////////
+
+const TransportOps transportOps[] = {
+    [TransportSerial] = {serialOpen, fdRead, fdWritev, serialClose},
+    [TransportPty] = {ptyOpen, fdRead, fdWritev, serialClose},
+    [TransportSocket] = {socketOpen, fdRead, fdWritev, fdClose},
+    [TransportMemory] = {memoryOpen, memoryRead, memoryWritev, memoryClose},
+};
+
+int transportOpen(Transport *transport, TransportType type, const char *name, int baudRate){
+    memset(transport, 0, sizeof(*transport));
+    if(type > TransportMemory) return -1;
+    transport->type = type;
+    transport->ops = &transportOps[type];
+    transport->fd = -1;
+    return transport->ops->open(transport, name, baudRate);
+}
+
+int transportRead(Transport *transport, unsigned char *buf, int size){
+    return transport->ops->read(transport, buf, size);
+}
+
+int transportWritev(Transport *transport, const struct iovec *iov, int iovcnt){
+    return transport->ops->writev(transport, iov, iovcnt);
+}
+
+int transportWrite(Transport *transport, const unsigned char *buf, int size){
+    struct iovec iov = {(void *)buf, size};
+    return transport->ops->writev(transport, &iov, 1);
+}
+
+int transportPoll(Transport *transport, int otherFd, int timeoutMs){
+    struct pollfd pfd[2] = {{transport->fd, POLLIN, 0}, {otherFd, POLLIN, 0}};
+    if(poll(pfd, otherFd >= 0 ? 2 : 1, timeoutMs) <= 0) return 0;
+    return ((pfd[0].revents & POLLIN) ? 1 : 0) | ((pfd[1].revents & POLLIN) ? 2 : 0) |
+           ((pfd[0].revents & (POLLHUP | POLLERR)) ? 4 : 0);
+}
+
+int transportClose(Transport *transport){
+    return transport->ops->close(transport);
+}
+
+const char *transportParse(const char *spec, TransportType *type){
+    static const struct {
+        const char *prefix;
+        TransportType type;
+    } prefixes[] = {
+        {"serial:", TransportSerial},
+        {"pty:", TransportPty},
+        {"socket:", TransportSocket},
+        {"mem:", TransportMemory},
+    };
+
+    for(unsigned int i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++){
+        int length = strlen(prefixes[i].prefix);
+        if(strncmp(spec, prefixes[i].prefix, length) == 0){
+            *type = prefixes[i].type;
+            return spec + length;
+        }
+    }
+    *type = TransportSerial;
+    return spec;
+}
+
+int transportSocketpair(int fds[2]){
+    return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+}